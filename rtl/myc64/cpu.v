@@ -24,6 +24,7 @@
 /* verilator lint_off CASEOVERLAP */
 
 module cpu( clk, reset, AB, DI, DO, WE, IRQ, NMI, RDY );
+/* verilator public_module */
 
 input clk;              // CPU clock 
 input reset;            // reset signal
@@ -39,7 +40,7 @@ input RDY;              // Ready signal. Pauses CPU when RDY=0
  * internal signals
  */
 
-reg  [15:0] PC;         // Program Counter 
+reg  [15:0] PC /* verilator public */;         // Program Counter 
 reg  [7:0] ABL;         // Address Bus Register LSB
 reg  [7:0] ABH;         // Address Bus Register MSB
 wire [7:0] ADD;         // Adder Hold Register (registered in ALU)
@@ -51,14 +52,14 @@ wire [7:0] DIMUX;       //
 reg  [7:0] IRHOLD;      // Hold for Instruction register 
 reg  IRHOLD_valid;      // Valid instruction in IRHOLD
 
-reg  [7:0] AXYS[3:0];   // A, X, Y and S register file
+reg  [7:0] AXYS[3:0] /* verilator public */;   // A, X, Y and S register file
 
-reg  C = 0;             // carry flag (init at zero to avoid X's in ALU sim)
-reg  Z = 0;             // zero flag
-reg  I = 0;             // interrupt flag
-reg  D = 0;             // decimal flag
-reg  V = 0;             // overflow flag
-reg  N = 0;             // negative flag
+reg  C /* verilator public */ = 0; // carry flag (init at zero to avoid X's in ALU sim)
+reg  Z /* verilator public */ = 0; // zero flag
+reg  I /* verilator public */ = 0; // interrupt flag
+reg  D /* verilator public */ = 0; // decimal flag
+reg  V /* verilator public */ = 0; // overflow flag
+reg  N /* verilator public */ = 0; // negative flag
 wire AZ;                // ALU Zero flag
 wire AV;                // ALU overflow flag
 wire AN;                // ALU negative flag
@@ -104,7 +105,7 @@ wire [7:0] P = { N, V, 2'b11, D, I, Z, C };
  * instruction decoder/sequencer
  */
 
-reg [5:0] state;
+reg [5:0] state /* verilator public */;
 
 /*
  * control signals
@@ -31,6 +31,7 @@ module cpu6510(
   output reg [5:0] PO,
   input [5:0] PI
 );
+  /* verilator public_module */
 
   wire [15:0] AB_w;
   wire [7:0] DI_w, DO_w;
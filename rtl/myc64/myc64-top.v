@@ -20,6 +20,18 @@
 
 `default_nettype none
 
+// ROM images for $readmemh, without them the ROMs start out empty and have to
+// be filled in some other way (as myc64-sim does).
+`ifndef MYC64_CHARACTERS_VH
+`define MYC64_CHARACTERS_VH ""
+`endif
+`ifndef MYC64_BASIC_VH
+`define MYC64_BASIC_VH ""
+`endif
+`ifndef MYC64_KERNAL_VH
+`define MYC64_KERNAL_VH ""
+`endif
+
 /* verilator lint_off CASEX */
 
 module myc64_top(
@@ -47,15 +59,16 @@ module myc64_top(
       clk_cntr <= clk_cntr + 3'h1;
   end
 
-  wire clk_1mhz_ph1_en;
+  wire clk_1mhz_ph1_en /* verilator public */;
   wire clk_1mhz_ph2_en;
   assign clk_1mhz_ph1_en = (clk_cntr == 3'b000);
   assign clk_1mhz_ph2_en = (clk_cntr == 3'b100);
 
-  wire [15:0] cpu_addr;
-  wire [7:0] cpu_do;
-  wire cpu_we;
-  reg [7:0] cpu_di;
+  // Public so that the simulator can watch the CPU bus.
+  wire [15:0] cpu_addr /* verilator public */;
+  wire [7:0] cpu_do /* verilator public */;
+  wire cpu_we /* verilator public */;
+  reg [7:0] cpu_di /* verilator public */;
   wire [5:0] cpu_po;
   wire [7:0] ram_main_ph1_do, ram_main_ph2_do, rom_basic_ph1_do, rom_kernal_ph1_do, rom_char_ph1_do, rom_char_ph2_do;
   wire [3:0] ram_color_ph1_do;
@@ -63,18 +76,22 @@ module myc64_top(
   wire [15:0] vic_addr, vic_addr_ph1;
   reg [7:0] vic_di;
   wire [7:0] vic_reg_do;
-  wire vic_ba, vic_bm;
+  wire vic_ba /* verilator public */;
+  wire vic_bm;
 
   wire [7:0] sid_do;
 
   wire [7:0] cia1_do;
   wire [7:0] cia1_pa;
   wire [7:0] cia1_pb;
-  wire cia1_irq;
+  wire cia1_irq /* verilator public */;
 
   reg ram_enabled;
 
-  reg vic_cs, sid_cs, color_cs, cia1_cs;
+  reg vic_cs /* verilator public */;
+  reg sid_cs /* verilator public */;
+  reg color_cs /* verilator public */;
+  reg cia1_cs /* verilator public */;
 
   reg [15:0] ext_addr_r;
   reg [7:0] ext_data_r;
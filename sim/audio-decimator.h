@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+// Turns the per cycle SID output into audio at a standard rate.
+//
+// The SID output only changes at 1 MHz so the first stage simply averages
+// each group of PreDecim input samples. The second stage is a polyphase
+// Kaiser windowed sinc filter evaluated at arbitrary fractional positions,
+// which handles the non-integer ratios down to 44.1 or 48 kHz. The phase
+// table is interpolated linearly between its two nearest rows.
+//
+// Passband is 0.375 * OutRate and everything above 0.625 * OutRate is
+// attenuated by about 80 dB, so nothing aliases into the passband.
+class AudioDecimator {
+public:
+  AudioDecimator(double InRate, unsigned PreDecim, double OutRate)
+      : m_PreDecim(PreDecim) {
+    double Rate = InRate / PreDecim;
+    m_Step = Rate / OutRate;
+
+    // Kaiser design: 80 dB attenuation over a transition band of
+    // 0.25 * OutRate centered on OutRate / 2.
+    const double Atten = 80.0;
+    double Transition = 0.25 * OutRate / Rate;
+    unsigned N = ceil((Atten - 7.95) / (14.36 * Transition)) + 1;
+    m_NumTaps = (N + 7) & ~7u;
+    double Beta = 0.1102 * (Atten - 8.7);
+    double Cutoff = 0.5 * OutRate / Rate;
+
+    double Center = m_NumTaps / 2.0;
+    m_Taps.resize((c_NumPhases + 1) * m_NumTaps);
+    for (unsigned p = 0; p <= c_NumPhases; p++) {
+      float *Row = &m_Taps[p * m_NumTaps];
+      double Sum = 0;
+      for (unsigned i = 0; i < m_NumTaps; i++) {
+        // Tap i weighs the sample that lies (NumTaps - 1 - i) - p / NumPhases
+        // input samples before the output instant.
+        double T = (m_NumTaps - 1 - i) - (double)p / c_NumPhases - Center;
+        double X = 2 * Cutoff * T;
+        double Sinc = X == 0 ? 1.0 : sin(M_PI * X) / (M_PI * X);
+        double R = T / Center;
+        double Window = R * R < 1.0 ? bessel_i0(Beta * sqrt(1 - R * R)) /
+                                          bessel_i0(Beta)
+                                    : 0.0;
+        Row[i] = 2 * Cutoff * Sinc * Window;
+        Sum += Row[i];
+      }
+      for (unsigned i = 0; i < m_NumTaps; i++)
+        Row[i] /= Sum;
+    }
+
+    m_History.assign(2 * m_NumTaps, 0.0f);
+  }
+
+  unsigned numTaps() const { return m_NumTaps; }
+
+  // Feed one input sample. Returns true and sets Out when an output sample
+  // is due.
+  bool push(int16_t In, int16_t &Out) {
+    m_Acc += In;
+    if (++m_AccCount < m_PreDecim)
+      return false;
+    float Sample = (float)m_Acc / m_PreDecim;
+    m_Acc = 0;
+    m_AccCount = 0;
+
+    // The history is stored twice so that the newest NumTaps samples are
+    // always contiguous, starting at m_History[m_Pos].
+    m_History[m_Pos] = m_History[m_Pos + m_NumTaps] = Sample;
+    if (++m_Pos == m_NumTaps)
+      m_Pos = 0;
+
+    m_Time += 1.0;
+    if (m_Time < m_Step)
+      return false;
+    m_Time -= m_Step;
+
+    // The output instant lies m_Time input samples before the newest one.
+    double Phase = m_Time * c_NumPhases;
+    unsigned p = (unsigned)Phase;
+    if (p >= c_NumPhases)
+      p = c_NumPhases - 1;
+    float Frac = Phase - p;
+    float A, B;
+    dot2(&m_History[m_Pos], &m_Taps[p * m_NumTaps],
+         &m_Taps[(p + 1) * m_NumTaps], m_NumTaps, A, B);
+    float Y = A + Frac * (B - A);
+    Out = Y > 32767.0f ? 32767 : Y < -32768.0f ? -32768 : (int16_t)lrintf(Y);
+    return true;
+  }
+
+private:
+  static double bessel_i0(double X) {
+    double Sum = 1.0, Term = 1.0;
+    for (int k = 1; k < 50; k++) {
+      Term *= (X / (2 * k)) * (X / (2 * k));
+      Sum += Term;
+      if (Term < 1e-12 * Sum)
+        break;
+    }
+    return Sum;
+  }
+
+  // Two dot products of X against TA and TB sharing the loads of X. N is a
+  // multiple of 8.
+  static void dot2(const float *X, const float *TA, const float *TB,
+                   unsigned N, float &A, float &B) {
+#if defined(__AVX__)
+    __m256 AccA = _mm256_setzero_ps();
+    __m256 AccB = _mm256_setzero_ps();
+    for (unsigned i = 0; i < N; i += 8) {
+      __m256 V = _mm256_loadu_ps(X + i);
+      AccA = _mm256_add_ps(AccA, _mm256_mul_ps(V, _mm256_loadu_ps(TA + i)));
+      AccB = _mm256_add_ps(AccB, _mm256_mul_ps(V, _mm256_loadu_ps(TB + i)));
+    }
+    __m128 SA = _mm_add_ps(_mm256_castps256_ps128(AccA),
+                           _mm256_extractf128_ps(AccA, 1));
+    __m128 SB = _mm_add_ps(_mm256_castps256_ps128(AccB),
+                           _mm256_extractf128_ps(AccB, 1));
+    A = hsum(SA);
+    B = hsum(SB);
+#elif defined(__SSE__)
+    __m128 AccA = _mm_setzero_ps();
+    __m128 AccB = _mm_setzero_ps();
+    for (unsigned i = 0; i < N; i += 4) {
+      __m128 V = _mm_loadu_ps(X + i);
+      AccA = _mm_add_ps(AccA, _mm_mul_ps(V, _mm_loadu_ps(TA + i)));
+      AccB = _mm_add_ps(AccB, _mm_mul_ps(V, _mm_loadu_ps(TB + i)));
+    }
+    A = hsum(AccA);
+    B = hsum(AccB);
+#else
+    A = B = 0.0f;
+    for (unsigned i = 0; i < N; i++) {
+      A += X[i] * TA[i];
+      B += X[i] * TB[i];
+    }
+#endif
+  }
+
+#if defined(__AVX__) || defined(__SSE__)
+  static float hsum(__m128 V) {
+    __m128 Shuf = _mm_shuffle_ps(V, V, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 Sums = _mm_add_ps(V, Shuf);
+    Shuf = _mm_movehl_ps(Shuf, Sums);
+    Sums = _mm_add_ss(Sums, Shuf);
+    return _mm_cvtss_f32(Sums);
+  }
+#endif
+
+  static const unsigned c_NumPhases = 128;
+  unsigned m_PreDecim;
+  double m_Step;
+  unsigned m_NumTaps;
+  std::vector<float> m_Taps;
+  std::vector<float> m_History;
+  unsigned m_Pos = 0;
+  double m_Time = 0.0;
+  int32_t m_Acc = 0;
+  unsigned m_AccCount = 0;
+};
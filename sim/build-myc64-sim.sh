@@ -2,14 +2,32 @@
 
 set -e
 
+# The simulator uses VerilatedContext and reaches the model's cells through
+# rootp, which needs Verilator 4.210 or later.
+VERILATOR_VERSION=$(verilator --version | awk '{print $2}')
+if ! printf '4.210\n%s\n' "$VERILATOR_VERSION" | sort -V -C; then
+  echo "Verilator $VERILATOR_VERSION found, myc64-sim needs 4.210 or later" >&2
+  exit 1
+fi
+
 OBJ_DIR=obj_dir_myc64
 rm -rf $OBJ_DIR
 
-verilator -trace -cc ../rtl/myc64/*.v +1364-2005ext+v --top-module myc64_top -Wno-fatal --Mdir $OBJ_DIR \
-+define+MYC64_CHARACTERS_VH='"../roms/characters.vh"' \
-+define+MYC64_BASIC_VH='"../roms/basic.vh"' \
-+define+MYC64_KERNAL_VH='"../roms/kernal.vh"'
+# TRACE_FST=1 selects the compressed .fst trace format instead of .vcd.
+if [ "$TRACE_FST" = "1" ]; then
+  TRACE_FLAGS="--trace-fst"
+  TRACE_SRCS="verilated_fst_c.cpp"
+  TRACE_DEFS="-DMYC64_TRACE_FST -lz"
+else
+  TRACE_FLAGS="-trace"
+  TRACE_SRCS="verilated_vcd_c.cpp"
+  TRACE_DEFS=""
+fi
+
+# The ROMs are not built into the model, myc64-sim loads them at startup (see
+# its --rom-* options).
+verilator $TRACE_FLAGS --savable --threads 1 -cc ../rtl/myc64/*.v +1364-2005ext+v --top-module myc64_top -Wno-fatal --Mdir $OBJ_DIR
 
 VERILATOR_ROOT=/usr/share/verilator/
 cd $OBJ_DIR; make -f Vmyc64_top.mk; cd ..
-g++ -std=c++14 myc64-sim.cpp $OBJ_DIR/Vmyc64_top__ALL.a -I$OBJ_DIR -I $VERILATOR_ROOT/include/ -I $VERILATOR_ROOT/include/vltstd $VERILATOR_ROOT/include/verilated.cpp $VERILATOR_ROOT/include/verilated_vcd_c.cpp -Werror -I../sw -o myc64-sim -O0 -g3 `pkg-config --cflags --libs gtk+-3.0`
+g++ -std=c++14 myc64-sim.cpp $OBJ_DIR/Vmyc64_top__ALL.a -I$OBJ_DIR -I $VERILATOR_ROOT/include/ -I $VERILATOR_ROOT/include/vltstd $VERILATOR_ROOT/include/verilated.cpp $VERILATOR_ROOT/include/$TRACE_SRCS $VERILATOR_ROOT/include/verilated_save.cpp $VERILATOR_ROOT/include/verilated_threads.cpp $TRACE_DEFS -Werror -I../sw -o myc64-sim -O0 -g3 -pthread -lrt `pkg-config --cflags --libs gtk+-3.0`
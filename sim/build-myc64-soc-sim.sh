@@ -4,7 +4,18 @@ set -e
 OBJ_DIR=obj_dir_myc64_soc
 rm -rf $OBJ_DIR
 
-verilator -trace -cc +1364-2005ext+v --top-module myc64_soc_top -Wno-fatal --Mdir $OBJ_DIR \
+# TRACE_FST=1 selects the compressed .fst trace format instead of .vcd.
+if [ "$TRACE_FST" = "1" ]; then
+  TRACE_FLAGS="--trace-fst"
+  TRACE_SRCS="verilated_fst_c.cpp"
+  TRACE_DEFS="-DMYC64_TRACE_FST -lz"
+else
+  TRACE_FLAGS="-trace"
+  TRACE_SRCS="verilated_vcd_c.cpp"
+  TRACE_DEFS=""
+fi
+
+verilator $TRACE_FLAGS -cc +1364-2005ext+v --top-module myc64_soc_top -Wno-fatal --Mdir $OBJ_DIR \
 +define+MYC64_CHARACTERS_VH='"../roms/characters.vh"' \
 +define+MYC64_BASIC_VH='"../roms/basic.vh"' \
 +define+MYC64_KERNAL_VH='"../roms/kernal.vh"' \
@@ -23,4 +34,4 @@ verilator -trace -cc +1364-2005ext+v --top-module myc64_soc_top -Wno-fatal --Mdi
 
 VERILATOR_ROOT=/usr/share/verilator/
 cd $OBJ_DIR; make -f Vmyc64_soc_top.mk; cd ..
-g++ -std=c++14 myc64-soc-sim.cpp $OBJ_DIR/Vmyc64_soc_top__ALL.a -I$OBJ_DIR/ -I$VERILATOR_ROOT/include/ -I$VERILATOR_ROOT/include/vltstd $VERILATOR_ROOT/include/verilated.cpp $VERILATOR_ROOT/include/verilated_vcd_c.cpp -Werror -I. -o myc64-soc-sim -O0 -g3 `pkg-config --cflags --libs gtk+-3.0`
+g++ -std=c++14 myc64-soc-sim.cpp $OBJ_DIR/Vmyc64_soc_top__ALL.a -I$OBJ_DIR/ -I$VERILATOR_ROOT/include/ -I$VERILATOR_ROOT/include/vltstd $VERILATOR_ROOT/include/verilated.cpp $VERILATOR_ROOT/include/$TRACE_SRCS $TRACE_DEFS -Werror -I. -o myc64-soc-sim -O0 -g3 -pthread `pkg-config --cflags --libs gtk+-3.0`
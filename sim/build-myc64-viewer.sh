@@ -0,0 +1,5 @@
+#!/bin/bash
+
+set -e
+
+g++ -std=c++14 myc64-viewer.cpp -Werror -I../sw -o myc64-viewer -O0 -g3 -lrt `pkg-config --cflags --libs gtk+-3.0`
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A condition on a single CPU bus cycle, either any access to an address
+// ("addr:ADDR") or a write to it, optionally of a given value
+// ("write:ADDR[=DATA]").
+struct BusTrigger {
+  enum Kind { None, Access, Write };
+
+  bool parse(const char *Str) {
+    const char *Arg;
+    if (!strncmp(Str, "addr:", 5)) {
+      m_Kind = Access;
+      Arg = Str + 5;
+    } else if (!strncmp(Str, "write:", 6)) {
+      m_Kind = Write;
+      Arg = Str + 6;
+    } else {
+      return false;
+    }
+    char *EndPtr;
+    m_Addr = strtoul(Arg, &EndPtr, 0);
+    if (EndPtr == Arg)
+      return false;
+    if (m_Kind == Write && *EndPtr == '=') {
+      Arg = EndPtr + 1;
+      m_Data = strtoul(Arg, &EndPtr, 0);
+      if (EndPtr == Arg)
+        return false;
+    }
+    return *EndPtr == '\0';
+  }
+
+  bool enabled() const { return m_Kind != None; }
+
+  bool match(uint16_t Addr, uint8_t Data, bool WE) const {
+    if (m_Kind == None || Addr != m_Addr)
+      return false;
+    if (m_Kind == Write && (!WE || (m_Data >= 0 && Data != (uint8_t)m_Data)))
+      return false;
+    return true;
+  }
+
+  Kind m_Kind = None;
+  uint16_t m_Addr = 0;
+  int m_Data = -1;
+};
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <inttypes.h>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Where the emulated 6502 spends its cycles. Every CPU cycle, including the
+// ones where the VIC-II holds the CPU, is charged to the address of the
+// instruction being executed, kept for the whole run and, if PerFrame, also
+// for the current frame. That is at most two increments per CPU cycle,
+// little next to the eight eval() calls that a CPU cycle takes.
+class CpuProfiler {
+public:
+  CpuProfiler(bool PerFrame)
+      : m_Cycles(0x10000), m_Insns(0x10000),
+        m_FrameCycles(PerFrame ? 0x10000 : 0) {}
+
+  // Once per CPU cycle with the address of the opcode fetched in it, -1 if
+  // it was not an opcode fetch.
+  void cycle(int Fetch) {
+    if (Fetch >= 0) {
+      m_Current = Fetch;
+      m_Insns[Fetch]++;
+    }
+    m_Cycles[m_Current]++;
+    if (!m_FrameCycles.empty())
+      m_FrameCycles[m_Current]++;
+  }
+
+  // Labels from an ld65 label file (-Ln, "al 00C000 .name" lines) or the
+  // exports of an ld65 map file (-m, "name 00C000 RLA" pairs).
+  bool loadLabels(const char *Path) {
+    FILE *fp = fopen(Path, "r");
+    if (!fp)
+      return false;
+    char Line[512];
+    bool InExports = false;
+    while (fgets(Line, sizeof(Line), fp)) {
+      char Name[256];
+      unsigned Addr;
+      if (sscanf(Line, "al %x .%255s", &Addr, Name) == 2) {
+        addLabel(Addr, Name);
+        continue;
+      }
+      if (!strncmp(Line, "Exports list", 12)) {
+        InExports = true;
+        continue;
+      }
+      if (InExports && !strncmp(Line, "Imports list", 12))
+        InExports = false;
+      if (!InExports)
+        continue;
+      // Up to two exports per line.
+      char Name2[256], Flags[16], Flags2[16];
+      unsigned Addr2;
+      int N = sscanf(Line, "%255s %x %15s %255s %x %15s", Name, &Addr, Flags,
+                     Name2, &Addr2, Flags2);
+      if (N >= 2)
+        addLabel(Addr, Name);
+      if (N >= 5)
+        addLabel(Addr2, Name2);
+    }
+    fclose(fp);
+    return true;
+  }
+
+  // The end of frame FrameIdx, writes a line to Out with the cycles of the
+  // frame per area and its three hottest addresses. Only when PerFrame.
+  void frame(int FrameIdx, FILE *Out) {
+    if (m_FrameCycles.empty())
+      return;
+    uint64_t Area[NumAreas] = {0, 0, 0};
+    for (unsigned A = 0; A < 0x10000; A++)
+      Area[area(A)] += m_FrameCycles[A];
+    std::vector<unsigned> Top = hottest(m_FrameCycles, 3);
+    fprintf(Out, "%d %" PRIu64 " %" PRIu64 " %" PRIu64, FrameIdx, Area[RAM],
+            Area[BasicROM], Area[KernalROM]);
+    for (unsigned A : Top)
+      fprintf(Out, " %s:%" PRIu64, name(A).c_str(), m_FrameCycles[A]);
+    fputc('\n', Out);
+    std::fill(m_FrameCycles.begin(), m_FrameCycles.end(), 0);
+  }
+
+  // The whole run: cycles per area, the TopN hottest addresses and, with
+  // labels, the cycles charged to each label (up to the next label, but not
+  // past the end of the area, so a program label does not take the ROM).
+  // Given Mem, the 64 KiB as the CPU sees them, the TopN hottest labels are
+  // also listed instruction by instruction.
+  void report(FILE *fp, unsigned TopN, const uint8_t *Mem = nullptr) const {
+    uint64_t Total = 0, Area[NumAreas] = {0, 0, 0};
+    for (unsigned A = 0; A < 0x10000; A++) {
+      Total += m_Cycles[A];
+      Area[area(A)] += m_Cycles[A];
+    }
+    if (!Total)
+      return;
+    auto Pct = [&](uint64_t N) { return 100.0 * N / Total; };
+
+    fprintf(fp, "=== 6502 profile, %" PRIu64 " cycles ===\n", Total);
+    fprintf(fp, "RAM          %12" PRIu64 " %6.2f%%\n", Area[RAM],
+            Pct(Area[RAM]));
+    fprintf(fp, "BASIC ROM    %12" PRIu64 " %6.2f%%\n", Area[BasicROM],
+            Pct(Area[BasicROM]));
+    fprintf(fp, "KERNAL ROM   %12" PRIu64 " %6.2f%%\n", Area[KernalROM],
+            Pct(Area[KernalROM]));
+
+    fprintf(fp, "--- Hottest addresses ---\n");
+    fprintf(fp, "%-24s %12s %7s %10s %6s\n", "address", "cycles", "", "insns",
+            "cpi");
+    for (unsigned A : hottest(m_Cycles, TopN))
+      fprintf(fp, "%-24s %12" PRIu64 " %6.2f%% %10" PRIu64 " %6.2f\n",
+              name(A).c_str(), m_Cycles[A], Pct(m_Cycles[A]), m_Insns[A],
+              m_Insns[A] ? (double)m_Cycles[A] / m_Insns[A] : 0.0);
+
+    if (m_Labels.empty())
+      return;
+    std::vector<std::pair<uint64_t, LabelIt>> ByLabel;
+    for (auto It = m_Labels.begin(); It != m_Labels.end(); ++It) {
+      uint64_t N = 0;
+      for (unsigned A = It->first; A < labelEnd(It); A++)
+        N += m_Cycles[A];
+      if (N)
+        ByLabel.push_back({N, It});
+    }
+    std::stable_sort(ByLabel.begin(), ByLabel.end(),
+                     [](const std::pair<uint64_t, LabelIt> &L,
+                        const std::pair<uint64_t, LabelIt> &R) {
+                       return L.first > R.first;
+                     });
+    if (ByLabel.size() > TopN)
+      ByLabel.resize(TopN);
+    fprintf(fp, "--- Hottest labels ---\n");
+    for (auto &L : ByLabel)
+      fprintf(fp, "%-24s %12" PRIu64 " %6.2f%%\n", L.second->second.c_str(),
+              L.first, Pct(L.first));
+
+    if (!Mem)
+      return;
+    fprintf(fp, "--- Annotated listing ---\n");
+    for (auto &L : ByLabel) {
+      fprintf(fp, "%s:\n", L.second->second.c_str());
+      for (unsigned A = L.second->first; A < labelEnd(L.second); A++)
+        if (m_Cycles[A])
+          fprintf(fp, "  %-24s %12" PRIu64 " %6.2f%% %10" PRIu64 "  %s\n",
+                  name(A).c_str(), m_Cycles[A], Pct(m_Cycles[A]), m_Insns[A],
+                  disassemble(Mem, A).c_str());
+    }
+  }
+
+private:
+  typedef std::map<unsigned, std::string>::const_iterator LabelIt;
+
+  // Assuming the default memory configuration with both ROMs banked in.
+  enum Area { RAM, BasicROM, KernalROM, NumAreas };
+  static Area area(unsigned Addr) {
+    if (Addr >= 0xa000 && Addr < 0xc000)
+      return BasicROM;
+    if (Addr >= 0xe000)
+      return KernalROM;
+    return RAM;
+  }
+
+  // The first address after the contiguous range of Addr's area.
+  static unsigned areaEnd(unsigned Addr) {
+    if (Addr < 0xa000)
+      return 0xa000;
+    if (Addr < 0xc000)
+      return 0xc000;
+    return Addr < 0xe000 ? 0xe000 : 0x10000;
+  }
+
+  // The end of the range charged to label It, see report().
+  unsigned labelEnd(LabelIt It) const {
+    auto Next = std::next(It);
+    unsigned End = areaEnd(It->first);
+    return Next != m_Labels.end() ? std::min(End, Next->first) : End;
+  }
+
+  // The documented 6502 instruction at Addr, e.g. "LDA $d012,X".
+  static std::string disassemble(const uint8_t *Mem, unsigned Addr) {
+    enum Mode {
+      IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL
+    };
+    static const struct {
+      uint8_t Opcode;
+      const char *Mnemonic;
+      Mode M;
+    } Insns[] = {
+        {0x00, "BRK", IMP}, {0x01, "ORA", IZX}, {0x05, "ORA", ZP},
+        {0x06, "ASL", ZP},  {0x08, "PHP", IMP}, {0x09, "ORA", IMM},
+        {0x0a, "ASL", ACC}, {0x0d, "ORA", ABS}, {0x0e, "ASL", ABS},
+        {0x10, "BPL", REL}, {0x11, "ORA", IZY}, {0x15, "ORA", ZPX},
+        {0x16, "ASL", ZPX}, {0x18, "CLC", IMP}, {0x19, "ORA", ABY},
+        {0x1d, "ORA", ABX}, {0x1e, "ASL", ABX}, {0x20, "JSR", ABS},
+        {0x21, "AND", IZX}, {0x24, "BIT", ZP},  {0x25, "AND", ZP},
+        {0x26, "ROL", ZP},  {0x28, "PLP", IMP}, {0x29, "AND", IMM},
+        {0x2a, "ROL", ACC}, {0x2c, "BIT", ABS}, {0x2d, "AND", ABS},
+        {0x2e, "ROL", ABS}, {0x30, "BMI", REL}, {0x31, "AND", IZY},
+        {0x35, "AND", ZPX}, {0x36, "ROL", ZPX}, {0x38, "SEC", IMP},
+        {0x39, "AND", ABY}, {0x3d, "AND", ABX}, {0x3e, "ROL", ABX},
+        {0x40, "RTI", IMP}, {0x41, "EOR", IZX}, {0x45, "EOR", ZP},
+        {0x46, "LSR", ZP},  {0x48, "PHA", IMP}, {0x49, "EOR", IMM},
+        {0x4a, "LSR", ACC}, {0x4c, "JMP", ABS}, {0x4d, "EOR", ABS},
+        {0x4e, "LSR", ABS}, {0x50, "BVC", REL}, {0x51, "EOR", IZY},
+        {0x55, "EOR", ZPX}, {0x56, "LSR", ZPX}, {0x58, "CLI", IMP},
+        {0x59, "EOR", ABY}, {0x5d, "EOR", ABX}, {0x5e, "LSR", ABX},
+        {0x60, "RTS", IMP}, {0x61, "ADC", IZX}, {0x65, "ADC", ZP},
+        {0x66, "ROR", ZP},  {0x68, "PLA", IMP}, {0x69, "ADC", IMM},
+        {0x6a, "ROR", ACC}, {0x6c, "JMP", IND}, {0x6d, "ADC", ABS},
+        {0x6e, "ROR", ABS}, {0x70, "BVS", REL}, {0x71, "ADC", IZY},
+        {0x75, "ADC", ZPX}, {0x76, "ROR", ZPX}, {0x78, "SEI", IMP},
+        {0x79, "ADC", ABY}, {0x7d, "ADC", ABX}, {0x7e, "ROR", ABX},
+        {0x81, "STA", IZX}, {0x84, "STY", ZP},  {0x85, "STA", ZP},
+        {0x86, "STX", ZP},  {0x88, "DEY", IMP}, {0x8a, "TXA", IMP},
+        {0x8c, "STY", ABS}, {0x8d, "STA", ABS}, {0x8e, "STX", ABS},
+        {0x90, "BCC", REL}, {0x91, "STA", IZY}, {0x94, "STY", ZPX},
+        {0x95, "STA", ZPX}, {0x96, "STX", ZPY}, {0x98, "TYA", IMP},
+        {0x99, "STA", ABY}, {0x9a, "TXS", IMP}, {0x9d, "STA", ABX},
+        {0xa0, "LDY", IMM}, {0xa1, "LDA", IZX}, {0xa2, "LDX", IMM},
+        {0xa4, "LDY", ZP},  {0xa5, "LDA", ZP},  {0xa6, "LDX", ZP},
+        {0xa8, "TAY", IMP}, {0xa9, "LDA", IMM}, {0xaa, "TAX", IMP},
+        {0xac, "LDY", ABS}, {0xad, "LDA", ABS}, {0xae, "LDX", ABS},
+        {0xb0, "BCS", REL}, {0xb1, "LDA", IZY}, {0xb4, "LDY", ZPX},
+        {0xb5, "LDA", ZPX}, {0xb6, "LDX", ZPY}, {0xb8, "CLV", IMP},
+        {0xb9, "LDA", ABY}, {0xba, "TSX", IMP}, {0xbc, "LDY", ABX},
+        {0xbd, "LDA", ABX}, {0xbe, "LDX", ABY}, {0xc0, "CPY", IMM},
+        {0xc1, "CMP", IZX}, {0xc4, "CPY", ZP},  {0xc5, "CMP", ZP},
+        {0xc6, "DEC", ZP},  {0xc8, "INY", IMP}, {0xc9, "CMP", IMM},
+        {0xca, "DEX", IMP}, {0xcc, "CPY", ABS}, {0xcd, "CMP", ABS},
+        {0xce, "DEC", ABS}, {0xd0, "BNE", REL}, {0xd1, "CMP", IZY},
+        {0xd5, "CMP", ZPX}, {0xd6, "DEC", ZPX}, {0xd8, "CLD", IMP},
+        {0xd9, "CMP", ABY}, {0xdd, "CMP", ABX}, {0xde, "DEC", ABX},
+        {0xe0, "CPX", IMM}, {0xe1, "SBC", IZX}, {0xe4, "CPX", ZP},
+        {0xe5, "SBC", ZP},  {0xe6, "INC", ZP},  {0xe8, "INX", IMP},
+        {0xe9, "SBC", IMM}, {0xea, "NOP", IMP}, {0xec, "CPX", ABS},
+        {0xed, "SBC", ABS}, {0xee, "INC", ABS}, {0xf0, "BEQ", REL},
+        {0xf1, "SBC", IZY}, {0xf5, "SBC", ZPX}, {0xf6, "INC", ZPX},
+        {0xf8, "SED", IMP}, {0xf9, "SBC", ABY}, {0xfd, "SBC", ABX},
+        {0xfe, "INC", ABX}};
+    uint8_t Op = Mem[Addr];
+    unsigned B1 = Mem[(Addr + 1) & 0xffff];
+    unsigned W = B1 | Mem[(Addr + 2) & 0xffff] << 8;
+    char Buf[32];
+    snprintf(Buf, sizeof(Buf), ".byte $%02x", Op);
+    for (auto &I : Insns) {
+      if (I.Opcode != Op)
+        continue;
+      static const char *const Formats[] = {
+          "%s",        "%s A",        "%s #$%02x",   "%s $%02x",
+          "%s $%02x,X", "%s $%02x,Y", "%s $%04x",    "%s $%04x,X",
+          "%s $%04x,Y", "%s ($%04x)", "%s ($%02x,X)", "%s ($%02x),Y",
+          "%s $%04x"};
+      unsigned Arg = I.M >= ABS && I.M <= IND ? W : B1;
+      if (I.M == REL)
+        Arg = (Addr + 2 + (int8_t)B1) & 0xffff;
+      snprintf(Buf, sizeof(Buf), Formats[I.M], I.Mnemonic, Arg);
+      break;
+    }
+    return Buf;
+  }
+
+  void addLabel(unsigned Addr, const char *Name) {
+    // Keep the first of several labels on the same address.
+    if (Addr < 0x10000)
+      m_Labels.insert({Addr, Name});
+  }
+
+  // $ADDR, followed by (label+offset) if there is a label before ADDR in the
+  // same area. Never contains spaces.
+  std::string name(unsigned Addr) const {
+    char Buf[300];
+    auto It = m_Labels.upper_bound(Addr);
+    if (It == m_Labels.begin() || areaEnd((--It)->first) <= Addr)
+      snprintf(Buf, sizeof(Buf), "$%04x", Addr);
+    else if (It->first == Addr)
+      snprintf(Buf, sizeof(Buf), "$%04x(%s)", Addr, It->second.c_str());
+    else
+      snprintf(Buf, sizeof(Buf), "$%04x(%s+%u)", Addr, It->second.c_str(),
+               Addr - It->first);
+    return Buf;
+  }
+
+  static std::vector<unsigned> hottest(const std::vector<uint64_t> &Counts,
+                                       unsigned N) {
+    std::vector<unsigned> Addrs;
+    for (unsigned A = 0; A < Counts.size(); A++)
+      if (Counts[A])
+        Addrs.push_back(A);
+    N = std::min<size_t>(N, Addrs.size());
+    std::partial_sort(Addrs.begin(), Addrs.begin() + N, Addrs.end(),
+                      [&](unsigned L, unsigned R) {
+                        return Counts[L] > Counts[R] ||
+                               (Counts[L] == Counts[R] && L < R);
+                      });
+    Addrs.resize(N);
+    return Addrs;
+  }
+
+  std::vector<uint64_t> m_Cycles;
+  std::vector<uint64_t> m_Insns;
+  std::vector<uint64_t> m_FrameCycles;
+  std::map<unsigned, std::string> m_Labels;
+  unsigned m_Current = 0;
+};
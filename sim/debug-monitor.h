@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+// The transport of the debug monitor, a Unix domain stream socket that one
+// client at a time can connect to. All numbers are little endian.
+//
+// A request is u8 Cmd, u16 Len and Len bytes of arguments:
+//   Peek     u8 Space, u16 Addr, u16 N    -> the N bytes
+//   Poke     u8 Space, u16 Addr, data     -> nothing
+//   Regs                                  -> registers, see below
+//   Stop                                  -> registers
+//   Cont                                  -> nothing
+//   Step     u32 Cycles                   -> registers
+//   RunToPC  u16 Addr, u32 MaxCycles      -> registers
+//   Frame                                 -> u16 W, u16 H, W x H 4-bit pixels
+// Every request gets a reply of u8 Status, u32 Len and Len bytes of data.
+// Addresses are relative to the start of Space. A Step or RunToPC that runs
+// into the end of the simulation (e.g. --exit-after-frame) is answered with
+// Finished and the simulator then exits, closing the connection.
+//
+// The registers are u16 PC, u8 A, X, Y, S, P, u8 CPU state, u16 address bus,
+// u8 data in, u8 data out, u8 flags (bit 0 write enable, bit 1 vic_ba, bit 2
+// IRQ), u64 cycle, u32 frame and u64 keyboard mask.
+class DebugMonitor {
+public:
+  enum Cmd { Peek = 1, Poke, Regs, Stop, Cont, Step, RunToPC, Frame };
+  enum Status { OK, BadCmd, BadArgs, NotReached, Finished };
+  enum Space { RAM, ColorRAM, BasicROM, KernalROM, CharROM };
+
+  struct Request {
+    uint8_t m_Cmd;
+    std::vector<uint8_t> m_Args;
+
+    bool has(size_t N) const { return m_Args.size() >= N; }
+    uint8_t u8(size_t Pos) const { return m_Args[Pos]; }
+    uint16_t u16(size_t Pos) const { return u8(Pos) | u8(Pos + 1) << 8; }
+    uint32_t u32(size_t Pos) const {
+      return u16(Pos) | (uint32_t)u16(Pos + 2) << 16;
+    }
+  };
+
+  static void put8(std::vector<uint8_t> &Out, uint8_t V) { Out.push_back(V); }
+  static void put16(std::vector<uint8_t> &Out, uint16_t V) {
+    put8(Out, V);
+    put8(Out, V >> 8);
+  }
+  static void put32(std::vector<uint8_t> &Out, uint32_t V) {
+    put16(Out, V);
+    put16(Out, V >> 16);
+  }
+  static void put64(std::vector<uint8_t> &Out, uint64_t V) {
+    put32(Out, V);
+    put32(Out, V >> 32);
+  }
+
+  ~DebugMonitor() {
+    disconnect();
+    if (m_Listen >= 0) {
+      close(m_Listen);
+      unlink(m_Path.c_str());
+    }
+  }
+
+  bool listen(const char *Path) {
+    struct sockaddr_un Addr;
+    if (strlen(Path) >= sizeof(Addr.sun_path))
+      return false;
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    strcpy(Addr.sun_path, Path);
+    m_Listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_Listen < 0)
+      return false;
+    unlink(Path);
+    if (bind(m_Listen, (struct sockaddr *)&Addr, sizeof(Addr)) ||
+        ::listen(m_Listen, 1)) {
+      close(m_Listen);
+      m_Listen = -1;
+      return false;
+    }
+    m_Path = Path;
+    return true;
+  }
+
+  bool connected() const { return m_Client >= 0; }
+
+  // Wait at most TimeoutMs (0 to just check) for the next request. Also
+  // accepts a client if there is none.
+  bool next(Request &R, int TimeoutMs) {
+    if (parse(R))
+      return true;
+    struct pollfd Fd = {connected() ? m_Client : m_Listen, POLLIN, 0};
+    if (poll(&Fd, 1, TimeoutMs) <= 0)
+      return false;
+    if (!connected()) {
+      m_Client = accept(m_Listen, nullptr, nullptr);
+      return false;
+    }
+    uint8_t Buf[4096];
+    ssize_t N = read(m_Client, Buf, sizeof(Buf));
+    if (N <= 0) {
+      disconnect();
+      return false;
+    }
+    m_In.insert(m_In.end(), Buf, Buf + N);
+    return parse(R);
+  }
+
+  void reply(Status S, const std::vector<uint8_t> &Data) {
+    std::vector<uint8_t> Out;
+    put8(Out, S);
+    put32(Out, Data.size());
+    Out.insert(Out.end(), Data.begin(), Data.end());
+    for (size_t Pos = 0; Pos < Out.size();) {
+      ssize_t N = send(m_Client, &Out[Pos], Out.size() - Pos, MSG_NOSIGNAL);
+      if (N <= 0) {
+        disconnect();
+        return;
+      }
+      Pos += N;
+    }
+  }
+
+private:
+  bool parse(Request &R) {
+    if (m_In.size() < 3)
+      return false;
+    size_t Len = m_In[1] | m_In[2] << 8;
+    if (m_In.size() < 3 + Len)
+      return false;
+    R.m_Cmd = m_In[0];
+    R.m_Args.assign(m_In.begin() + 3, m_In.begin() + 3 + Len);
+    m_In.erase(m_In.begin(), m_In.begin() + 3 + Len);
+    return true;
+  }
+
+  void disconnect() {
+    if (m_Client >= 0)
+      close(m_Client);
+    m_Client = -1;
+    m_In.clear();
+  }
+
+  std::string m_Path;
+  int m_Listen = -1;
+  int m_Client = -1;
+  std::vector<uint8_t> m_In;
+};
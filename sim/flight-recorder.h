@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+// Keeps the last N CPU bus cycles in a fixed size ring so that the events
+// leading up to a problem can be written out after the fact, either as a
+// .vcd for a waveform viewer or in a compact binary form:
+//
+//   "MYC64FR2", uint32_t NumEntries, uint32_t sizeof(Entry), then the
+//   entries oldest first (host byte order).
+//
+// Recording is a single store per CPU cycle so it can be left on.
+class FlightRecorder {
+public:
+  enum Flags {
+    WE = 1 << 0,
+    VicBA = 1 << 1,
+    VicCS = 1 << 2,
+    SidCS = 1 << 3,
+    ColorCS = 1 << 4,
+    Cia1CS = 1 << 5,
+    IRQ = 1 << 6,
+  };
+
+  struct Entry {
+    uint64_t m_Cycle;
+    uint16_t m_Addr;
+    uint8_t m_DO;
+    uint8_t m_DI;
+    uint8_t m_Flags;
+  };
+
+  // Size is rounded up to a power of two.
+  FlightRecorder(unsigned Size) {
+    unsigned N = 1;
+    while (N < Size)
+      N <<= 1;
+    m_Ring.resize(N);
+    m_Mask = N - 1;
+  }
+
+  void record(uint64_t Cycle, uint16_t Addr, uint8_t DO, uint8_t DI,
+              uint8_t Flags) {
+    Entry &E = m_Ring[m_Count++ & m_Mask];
+    E.m_Cycle = Cycle;
+    E.m_Addr = Addr;
+    E.m_DO = DO;
+    E.m_DI = DI;
+    E.m_Flags = Flags;
+  }
+
+  bool writeBinary(const char *Path) const {
+    FILE *fp = fopen(Path, "wb");
+    if (!fp)
+      return false;
+    uint32_t N = size(), EntrySize = sizeof(Entry);
+    fwrite("MYC64FR2", 8, 1, fp);
+    fwrite(&N, sizeof(N), 1, fp);
+    fwrite(&EntrySize, sizeof(EntrySize), 1, fp);
+    for (uint32_t i = 0; i < N; i++)
+      fwrite(&at(i), sizeof(Entry), 1, fp);
+    fclose(fp);
+    return true;
+  }
+
+  // Time is in ns (one 8 MHz cycle is 125 ns) and only changes are written.
+  bool writeVCD(const char *Path) const {
+    static const struct {
+      const char *Name;
+      uint8_t Flag;
+    } FlagSignals[] = {{"cpu_we", WE},          {"vic_ba", VicBA},
+                       {"vic_cs", VicCS},       {"sid_cs", SidCS},
+                       {"color_cs", ColorCS},   {"cia1_cs", Cia1CS},
+                       {"cia1_irq", IRQ}};
+    FILE *fp = fopen(Path, "w");
+    if (!fp)
+      return false;
+    fprintf(fp, "$timescale 1ns $end\n$scope module myc64_top $end\n");
+    fprintf(fp, "$var wire 16 a cpu_addr $end\n");
+    fprintf(fp, "$var wire 8 o cpu_do $end\n");
+    fprintf(fp, "$var wire 8 i cpu_di $end\n");
+    for (unsigned j = 0; j < 7; j++)
+      fprintf(fp, "$var wire 1 %c %s $end\n", '0' + j, FlagSignals[j].Name);
+    fprintf(fp, "$upscope $end\n$enddefinitions $end\n");
+
+    const Entry *Prev = nullptr;
+    for (uint32_t i = 0, N = size(); i < N; i++) {
+      const Entry &E = at(i);
+      fprintf(fp, "#%llu\n", (unsigned long long)E.m_Cycle * 125);
+      if (!Prev || Prev->m_Addr != E.m_Addr)
+        writeVector(fp, E.m_Addr, 16, 'a');
+      if (!Prev || Prev->m_DO != E.m_DO)
+        writeVector(fp, E.m_DO, 8, 'o');
+      if (!Prev || Prev->m_DI != E.m_DI)
+        writeVector(fp, E.m_DI, 8, 'i');
+      for (unsigned j = 0; j < 7; j++) {
+        uint8_t F = FlagSignals[j].Flag;
+        if (!Prev || (Prev->m_Flags & F) != (E.m_Flags & F))
+          fprintf(fp, "%c%c\n", E.m_Flags & F ? '1' : '0', '0' + j);
+      }
+      Prev = &E;
+    }
+    fclose(fp);
+    return true;
+  }
+
+private:
+  uint32_t size() const {
+    return m_Count < m_Ring.size() ? m_Count : m_Ring.size();
+  }
+
+  // The i:th oldest entry.
+  const Entry &at(uint32_t i) const {
+    return m_Ring[(m_Count - size() + i) & m_Mask];
+  }
+
+  static void writeVector(FILE *fp, unsigned Value, unsigned Bits, char Id) {
+    fputc('b', fp);
+    for (int b = Bits - 1; b >= 0; b--)
+      fputc(Value & (1 << b) ? '1' : '0', fp);
+    fprintf(fp, " %c\n", Id);
+  }
+
+  std::vector<Entry> m_Ring;
+  uint64_t m_Mask;
+  uint64_t m_Count = 0;
+};
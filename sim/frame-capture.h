@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Packed RGB888 frame buffer (no row padding) that the simulators write the
+// video output into. A GdkPixbuf can be wrapped around data() without any
+// copying, see gdk_pixbuf_new_from_data().
+class FrameBuffer {
+public:
+  typedef uint32_t Pixel;
+
+  FrameBuffer(unsigned Width, unsigned Height)
+      : m_Width(Width), m_Height(Height), m_Pixels(Width * Height * 3) {}
+
+  unsigned width() const { return m_Width; }
+  unsigned height() const { return m_Height; }
+  unsigned stride() const { return m_Width * 3; }
+  uint8_t *data() { return m_Pixels.data(); }
+  const uint8_t *data() const { return m_Pixels.data(); }
+  size_t size() const { return m_Pixels.size(); }
+
+  uint8_t *line(unsigned Y) { return &m_Pixels[Y * stride()]; }
+
+  // Out of range coordinates are silently dropped.
+  void putPixel(unsigned X, unsigned Y, uint32_t RGB) {
+    if (X < m_Width && Y < m_Height) {
+      uint8_t *p = &m_Pixels[(Y * m_Width + X) * 3];
+      p[0] = RGB >> 16;
+      p[1] = RGB >> 8;
+      p[2] = RGB;
+    }
+  }
+
+  // Pixel X of the line starting LineOffset bytes in, no range check.
+  void putLinePixel(size_t LineOffset, unsigned X, uint32_t RGB) {
+    uint8_t *p = &m_Pixels[LineOffset + X * 3];
+    p[0] = RGB >> 16;
+    p[1] = RGB >> 8;
+    p[2] = RGB;
+  }
+
+  void clear() { memset(m_Pixels.data(), 0, m_Pixels.size()); }
+
+private:
+  unsigned m_Width;
+  unsigned m_Height;
+  std::vector<uint8_t> m_Pixels;
+};
+
+// Frame of 4-bit VIC-II color indices, two pixels per byte with the left one
+// in the high nibble (the PNG order). A sixth of the size of a FrameBuffer.
+class IndexedFrame {
+public:
+  typedef uint8_t Pixel;
+
+  IndexedFrame(unsigned Width, unsigned Height)
+      : m_Width(Width), m_Height(Height),
+        m_Pixels((Width + 1) / 2 * Height) {}
+
+  unsigned width() const { return m_Width; }
+  unsigned height() const { return m_Height; }
+  unsigned stride() const { return (m_Width + 1) / 2; }
+  uint8_t *data() { return m_Pixels.data(); }
+  const uint8_t *data() const { return m_Pixels.data(); }
+  size_t size() const { return m_Pixels.size(); }
+
+  const uint8_t *line(unsigned Y) const { return &m_Pixels[Y * stride()]; }
+
+  void putLinePixel(size_t LineOffset, unsigned X, uint8_t Idx) {
+    uint8_t &B = m_Pixels[LineOffset + X / 2];
+    B = X & 1 ? (B & 0xf0) | (Idx & 0xf) : (B & 0x0f) | (Idx & 0xf) << 4;
+  }
+
+private:
+  unsigned m_Width;
+  unsigned m_Height;
+  std::vector<uint8_t> m_Pixels;
+};
+
+// The 16 colors of the VIC-II, turns an IndexedFrame into RGB a byte (two
+// pixels) at a time through a 256 entry table.
+class Palette {
+public:
+  Palette() { set(builtin("myc64")); }
+
+  // A built-in palette by name or nullptr if there is no such palette.
+  static const uint32_t *builtin(const char *Name) {
+    // The table in rtl/myc64/myc64-top.v.
+    static const uint32_t MyC64[16] = {
+        0x000000, 0xffffff, 0x880000, 0xaaffee, 0xcc44cc, 0x00cc55,
+        0x0000aa, 0xeeee77, 0xdd8855, 0x664400, 0xff7777, 0x333333,
+        0x777777, 0xaaff66, 0x0088ff, 0xbbbbbb};
+    // https://www.pepto.de/projects/colorvic/2001/
+    static const uint32_t Pepto[16] = {
+        0x000000, 0xffffff, 0x68372b, 0x70a4b2, 0x6f3d86, 0x588d43,
+        0x352879, 0xb8c76f, 0x6f4f25, 0x433900, 0x9a6759, 0x444444,
+        0x6c6c6c, 0x9ad284, 0x6c5eb5, 0x959595};
+    // https://www.colodore.com/
+    static const uint32_t Colodore[16] = {
+        0x000000, 0xffffff, 0x813338, 0x75cec8, 0x8e3c97, 0x56ac4d,
+        0x2e2c9b, 0xedf171, 0x8e5029, 0x553800, 0xc46c71, 0x4a4a4a,
+        0x7b7b7b, 0xa9ff9f, 0x706deb, 0xb2b2b2};
+    if (!strcmp(Name, "myc64"))
+      return MyC64;
+    if (!strcmp(Name, "pepto"))
+      return Pepto;
+    if (!strcmp(Name, "colodore"))
+      return Colodore;
+    return nullptr;
+  }
+
+  // A built-in name or a file with 16 RRGGBB hex values.
+  bool load(const char *NameOrPath) {
+    if (const uint32_t *Colors = builtin(NameOrPath)) {
+      set(Colors);
+      return true;
+    }
+    FILE *fp = fopen(NameOrPath, "r");
+    if (!fp)
+      return false;
+    uint32_t Colors[16];
+    unsigned N = 0;
+    while (N < 16 && fscanf(fp, " %x", &Colors[N]) == 1)
+      N++;
+    fclose(fp);
+    if (N != 16)
+      return false;
+    set(Colors);
+    return true;
+  }
+
+  void set(const uint32_t *Colors) {
+    memcpy(m_Colors, Colors, sizeof(m_Colors));
+    for (unsigned B = 0; B < 256; B++) {
+      uint32_t L = Colors[B >> 4], R = Colors[B & 0xf];
+      uint8_t *p = m_Pairs[B];
+      p[0] = L >> 16;
+      p[1] = L >> 8;
+      p[2] = L;
+      p[3] = R >> 16;
+      p[4] = R >> 8;
+      p[5] = R;
+    }
+  }
+
+  uint32_t rgb(unsigned Idx) const { return m_Colors[Idx & 0xf]; }
+
+  // Both frames must have the same dimensions.
+  void expand(const IndexedFrame &In, FrameBuffer &Out) const {
+    unsigned Pairs = In.width() / 2;
+    for (unsigned Y = 0; Y < In.height(); Y++) {
+      const uint8_t *Src = In.line(Y);
+      uint8_t *Dst = Out.line(Y);
+      for (unsigned i = 0; i < Pairs; i++, Dst += 6)
+        memcpy(Dst, m_Pairs[Src[i]], 6);
+      if (In.width() & 1)
+        memcpy(Dst, m_Pairs[Src[Pairs]], 3);
+    }
+  }
+
+private:
+  uint32_t m_Colors[16];
+  uint8_t m_Pairs[256][6];
+};
+
+// Follows the VIC-II raster through its (level sensitive) hsync/vsync outputs
+// and stores the visible window, starting XOffset pixels after hsync and
+// YOffset lines after vsync, in a FrameBuffer (RGB) or an IndexedFrame. Call
+// once per pixel clock.
+template <class FrameT> class BasicRasterCapture {
+public:
+  BasicRasterCapture(unsigned Width, unsigned Height, unsigned XOffset,
+                     unsigned YOffset)
+      : m_Frame(Width, Height), m_XOffset(XOffset), m_YOffset(YOffset) {
+    startLine();
+  }
+
+  // Returns true when vsync is seen, i.e. the previous frame is complete.
+  bool clock(bool HSync, bool VSync, typename FrameT::Pixel Pixel) {
+    bool FrameDone = false;
+    if (HSync) {
+      m_HCntr = 0;
+      m_VCntr++;
+      startLine();
+    }
+    if (VSync) {
+      m_VCntr = 0;
+      FrameDone = true;
+      startLine();
+    }
+    if (m_LineVisible && m_HCntr - m_XOffset < m_Frame.width())
+      m_Frame.putLinePixel(m_LineOffset, m_HCntr - m_XOffset, Pixel);
+    m_HCntr++;
+    return FrameDone;
+  }
+
+  FrameT &frame() { return m_Frame; }
+
+  // Raster position, exposed so that it can be saved and restored.
+  unsigned hcntr() const { return m_HCntr; }
+  unsigned vcntr() const { return m_VCntr; }
+  void setPosition(unsigned HCntr, unsigned VCntr) {
+    m_HCntr = HCntr;
+    m_VCntr = VCntr;
+    startLine();
+  }
+
+private:
+  // Look up the destination line once per raster line rather than per pixel.
+  // An offset rather than a pointer so that copies stay valid.
+  void startLine() {
+    unsigned Y = m_VCntr - m_YOffset;
+    m_LineVisible = Y < m_Frame.height();
+    m_LineOffset = m_LineVisible ? Y * m_Frame.stride() : 0;
+  }
+
+  FrameT m_Frame;
+  unsigned m_XOffset;
+  unsigned m_YOffset;
+  unsigned m_HCntr = 0;
+  unsigned m_VCntr = 0;
+  bool m_LineVisible = false;
+  size_t m_LineOffset = 0;
+};
+
+typedef BasicRasterCapture<FrameBuffer> RasterCapture;
+typedef BasicRasterCapture<IndexedFrame> IndexedRasterCapture;
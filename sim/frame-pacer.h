@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+
+// Keeps the simulation at the speed of the real machine. Each finished frame
+// moves the deadline forward by the emulated time of the cycles it took, so
+// there is no drift no matter how long a frame is. Ahead of the deadline the
+// caller is put to sleep until it, behind it frames are still simulated but
+// not displayed until it has caught up. If it falls more than MaxLag behind
+// (the host is too slow or the simulation was stopped) the deadline is moved
+// to now instead of trying to make up for all of it.
+class FramePacer {
+  typedef std::chrono::steady_clock Clock;
+
+public:
+  FramePacer(double ClockHz, double MaxLag = 0.25, unsigned MaxSkip = 4)
+      : m_ClockHz(ClockHz),
+        m_MaxLag(std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(MaxLag))),
+        m_MaxSkip(MaxSkip) {}
+
+  void start(uint64_t Cycle) {
+    m_Deadline = m_Wake = Clock::now();
+    m_Cycle = Cycle;
+  }
+
+  // The cycle counter jumped, e.g. on a rewind, continue from here.
+  void resync(uint64_t Cycle) { start(Cycle); }
+
+  // Called when a frame has been simulated, returns false if it should not be
+  // displayed as the simulation is behind.
+  bool frame(uint64_t Cycle) {
+    double Seconds = (Cycle - m_Cycle) / m_ClockHz;
+    m_Cycle = Cycle;
+    m_Deadline += std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(Seconds));
+    m_EmulatedSeconds += Seconds;
+
+    Clock::time_point Now = Clock::now();
+    m_BusySeconds += std::chrono::duration<double>(Now - m_Wake).count();
+
+    bool Display = true;
+    if (Now < m_Deadline) {
+      std::this_thread::sleep_until(m_Deadline);
+      Now = Clock::now();
+    } else if (Now - m_Deadline > m_MaxLag) {
+      m_Deadline = Now;
+      m_Resyncs++;
+    } else if (m_Skipped < m_MaxSkip) {
+      // Still show every few frames so that the display never freezes.
+      Display = false;
+    }
+    m_Wake = Now;
+
+    if (Display) {
+      m_Skipped = 0;
+    } else {
+      m_Skipped++;
+      m_SkippedTotal++;
+    }
+    return Display;
+  }
+
+  // The share of real time that was left over after simulating, negative if
+  // the host could not keep up.
+  double headroom() const {
+    return m_EmulatedSeconds > 0 ? 1 - m_BusySeconds / m_EmulatedSeconds : 0;
+  }
+
+  void report(FILE *fp) const {
+    fprintf(fp,
+            "Real-time headroom %.1f%% (%.2f s busy for %.2f s emulated), %u "
+            "frames not displayed, %u resyncs\n",
+            100 * headroom(), m_BusySeconds, m_EmulatedSeconds, m_SkippedTotal,
+            m_Resyncs);
+  }
+
+private:
+  double m_ClockHz;
+  Clock::duration m_MaxLag;
+  unsigned m_MaxSkip;
+  Clock::time_point m_Deadline;
+  // When the caller last got control back, i.e. started simulating.
+  Clock::time_point m_Wake;
+  uint64_t m_Cycle = 0;
+  double m_EmulatedSeconds = 0;
+  double m_BusySeconds = 0;
+  unsigned m_Skipped = 0;
+  unsigned m_SkippedTotal = 0;
+  unsigned m_Resyncs = 0;
+};
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Keyboard input timelines, i.e. every change of the keyboard mask together
+// with the cycle it took effect on. The file is
+//
+//   "MYC64IN2", uint64_t StartCycle (little endian), then one record per
+//   change: varint(Cycle - previous Cycle), varint(Mask ^ previous Mask).
+//
+// where a varint is seven bits per byte, least significant first, with bit 7
+// set on all but the last byte. A key press or release takes a handful of
+// bytes.
+class InputLogWriter {
+public:
+  ~InputLogWriter() { close(); }
+
+  bool open(const char *Path, uint64_t StartCycle) {
+    m_fp = fopen(Path, "wb");
+    if (!m_fp)
+      return false;
+    fwrite("MYC64IN2", 8, 1, m_fp);
+    for (unsigned i = 0; i < 8; i++)
+      fputc(StartCycle >> (8 * i), m_fp);
+    m_Cycle = StartCycle;
+    return true;
+  }
+
+  void close() {
+    if (m_fp)
+      fclose(m_fp);
+    m_fp = nullptr;
+  }
+
+  void change(uint64_t Cycle, uint64_t Mask) {
+    putVarint(Cycle - m_Cycle);
+    putVarint(Mask ^ m_Mask);
+    m_Cycle = Cycle;
+    m_Mask = Mask;
+  }
+
+private:
+  void putVarint(uint64_t Value) {
+    while (Value >= 0x80) {
+      fputc(0x80 | (Value & 0x7f), m_fp);
+      Value >>= 7;
+    }
+    fputc(Value, m_fp);
+  }
+
+  FILE *m_fp = nullptr;
+  uint64_t m_Cycle = 0;
+  uint64_t m_Mask = 0;
+};
+
+class InputLogReader {
+public:
+  ~InputLogReader() {
+    if (m_fp)
+      fclose(m_fp);
+  }
+
+  bool open(const char *Path) {
+    m_fp = fopen(Path, "rb");
+    if (!m_fp)
+      return false;
+    char Magic[8];
+    uint8_t Start[8];
+    if (fread(Magic, sizeof(Magic), 1, m_fp) != 1 ||
+        memcmp(Magic, "MYC64IN2", 8) ||
+        fread(Start, sizeof(Start), 1, m_fp) != 1) {
+      fclose(m_fp);
+      m_fp = nullptr;
+      return false;
+    }
+    m_StartCycle = 0;
+    for (unsigned i = 0; i < 8; i++)
+      m_StartCycle |= (uint64_t)Start[i] << (8 * i);
+    m_Cycle = m_StartCycle;
+    advance();
+    return true;
+  }
+
+  uint64_t startCycle() const { return m_StartCycle; }
+
+  // True while there are changes left, nextCycle() is then the cycle of the
+  // next one.
+  bool pending() const { return m_Pending; }
+  uint64_t nextCycle() const { return m_Cycle; }
+
+  // Returns the mask of the next change and moves on to the one after.
+  uint64_t next() {
+    uint64_t Mask = m_Mask;
+    advance();
+    return Mask;
+  }
+
+private:
+  void advance() {
+    uint64_t Delta, Diff;
+    m_Pending = getVarint(Delta) && getVarint(Diff);
+    if (!m_Pending) {
+      if (m_fp)
+        fclose(m_fp);
+      m_fp = nullptr;
+      return;
+    }
+    m_Cycle += Delta;
+    m_Mask ^= Diff;
+  }
+
+  bool getVarint(uint64_t &Value) {
+    Value = 0;
+    if (!m_fp)
+      return false;
+    for (unsigned Shift = 0; Shift < 64; Shift += 7) {
+      int C = fgetc(m_fp);
+      if (C == EOF)
+        return false;
+      Value |= (uint64_t)(C & 0x7f) << Shift;
+      if (!(C & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  FILE *m_fp = nullptr;
+  uint64_t m_StartCycle = 0;
+  uint64_t m_Cycle = 0;
+  uint64_t m_Mask = 0;
+  bool m_Pending = false;
+};
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <ctype.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <strings.h>
+#include <vector>
+
+// Serves KERNAL LOAD and SAVE on device 8 from a host directory.
+//
+// A small stub is put in the unused RAM at $02a7 and the ILOAD ($0330) and
+// ISAVE ($0332) vectors are pointed at it. The simulator calls load() or
+// save() when the CPU fetches the opcode at loadTrap() or saveTrap(); these
+// do the whole transfer directly in RAM and leave the outcome for the stub,
+// which then returns to the caller with carry, A, X and Y set as the KERNAL
+// would. Other devices fall through to the KERNAL routines. Only RAM is
+// touched, the CPU itself is left alone.
+class KernalDiskTrap {
+public:
+  KernalDiskTrap(const char *Dir) : m_Dir(Dir) {}
+
+  // (Re)install the stub whenever the vectors hold their KERNAL defaults,
+  // which they do again after each reset or RUN/STOP-RESTORE.
+  void install(uint8_t *RAM) {
+    if (vector(RAM, 0x330) != c_KernalLoad ||
+        vector(RAM, 0x332) != c_KernalSave)
+      return;
+    // clang-format off
+    static const uint8_t Stub[] = {
+      // Load: the KERNAL also starts with STA $93 (0 = LOAD, 1 = VERIFY).
+      0x85, 0x93,                 // $02a7 STA $93
+      0xea,                       // $02a9 NOP
+      0x2c, 0xf8, 0x02,           // $02aa BIT Handled   <- load trap
+      0x30, 0x03,                 // $02ad BMI $02b2
+      0x4c, 0xa5, 0xf4,           // $02af JMP $f4a5
+      // Return the outcome left by load() or save(). Placed between the two
+      // entries so that neither runs into the other's trap.
+      0xad, 0xf9, 0x02,           // $02b2 LDA Carry
+      0x4a,                       // $02b5 LSR A
+      0xae, 0xfb, 0x02,           // $02b6 LDX ResX
+      0xac, 0xfc, 0x02,           // $02b9 LDY ResY
+      0xad, 0xfa, 0x02,           // $02bc LDA ResA
+      0x60,                       // $02bf RTS
+      // Save.
+      0xea,                       // $02c0 NOP
+      0x2c, 0xf8, 0x02,           // $02c1 BIT Handled   <- save trap
+      0x30, 0xec,                 // $02c4 BMI $02b2
+      0x4c, 0xed, 0xf5,           // $02c6 JMP $f5ed
+    };
+    // clang-format on
+    memcpy(&RAM[c_Base], Stub, sizeof(Stub));
+    RAM[0x330] = c_Base & 0xff;
+    RAM[0x331] = c_Base >> 8;
+    RAM[0x332] = c_SaveEntry & 0xff;
+    RAM[0x333] = c_SaveEntry >> 8;
+  }
+
+  static uint16_t loadTrap() { return c_Base + 3; }
+  static uint16_t saveTrap() { return c_SaveEntry + 1; }
+
+  void load(uint8_t *RAM) {
+    if (RAM[0xba] != 8) {
+      RAM[c_Handled] = 0;
+      return;
+    }
+    RAM[c_Handled] = 0x80;
+    std::string Path;
+    FILE *fp = findFile(fileName(RAM), Path) ? fopen(Path.c_str(), "rb")
+                                             : nullptr;
+    std::vector<uint8_t> Data;
+    if (fp) {
+      int C;
+      while ((C = fgetc(fp)) != EOF)
+        Data.push_back(C);
+      fclose(fp);
+    }
+    if (Data.size() < 2) {
+      // ?FILE NOT FOUND
+      RAM[0x90] = 0x42;
+      result(RAM, true, 4, 0);
+      return;
+    }
+    // Secondary address 0 loads to $c3/$c4, otherwise to the file's address.
+    uint16_t Addr = RAM[0xb9] ? Data[0] | Data[1] << 8 : vector(RAM, 0xc3);
+    bool Verify = RAM[0x93] != 0;
+    uint8_t Status = 0;
+    for (size_t i = 2; i < Data.size(); i++, Addr++) {
+      if (!Verify)
+        RAM[Addr] = Data[i];
+      else if (RAM[Addr] != Data[i])
+        Status = 0x10;
+    }
+    RAM[0x90] = Status;
+    RAM[0xae] = Addr & 0xff;
+    RAM[0xaf] = Addr >> 8;
+    fprintf(stderr, "Drive 8: loaded '%s'\n", Path.c_str());
+    result(RAM, false, 0, Addr);
+  }
+
+  // Writes $c1/$c2 up to (but excluding) $ae/$af, as a .prg with the start
+  // address first.
+  void save(uint8_t *RAM) {
+    if (RAM[0xba] != 8) {
+      RAM[c_Handled] = 0;
+      return;
+    }
+    RAM[c_Handled] = 0x80;
+    std::string Name = fileName(RAM);
+    if (Name.empty() || Name.find('/') != std::string::npos) {
+      // ?MISSING FILE NAME
+      result(RAM, true, 8, 0);
+      return;
+    }
+    if (Name.find('.') == std::string::npos)
+      Name += ".prg";
+    std::string Path = m_Dir + "/" + Name;
+    FILE *fp = fopen(Path.c_str(), "wb");
+    if (!fp) {
+      // ?DEVICE NOT PRESENT
+      RAM[0x90] = 0x80;
+      result(RAM, true, 5, 0);
+      return;
+    }
+    uint16_t Start = vector(RAM, 0xc1), End = vector(RAM, 0xae);
+    fputc(Start & 0xff, fp);
+    fputc(Start >> 8, fp);
+    for (uint16_t Addr = Start; Addr != End; Addr++)
+      fputc(RAM[Addr], fp);
+    fclose(fp);
+    RAM[0x90] = 0;
+    fprintf(stderr, "Drive 8: saved '%s'\n", Path.c_str());
+    result(RAM, false, 0, End);
+  }
+
+private:
+  static const uint16_t c_Base = 0x2a7;
+  static const uint16_t c_SaveEntry = 0x2c0;
+  static const uint16_t c_Handled = 0x2f8;
+  static const uint16_t c_Carry = 0x2f9;
+  static const uint16_t c_ResA = 0x2fa;
+  static const uint16_t c_ResX = 0x2fb;
+  static const uint16_t c_ResY = 0x2fc;
+  static const uint16_t c_KernalLoad = 0xf4a5;
+  static const uint16_t c_KernalSave = 0xf5ed;
+
+  static uint16_t vector(const uint8_t *RAM, uint16_t Addr) {
+    return RAM[Addr] | RAM[Addr + 1] << 8;
+  }
+
+  static void result(uint8_t *RAM, bool Error, uint8_t A, uint16_t XY) {
+    RAM[c_Carry] = Error;
+    RAM[c_ResA] = A;
+    RAM[c_ResX] = XY & 0xff;
+    RAM[c_ResY] = XY >> 8;
+  }
+
+  // The file name from $bb/$bc (length at $b7) with PETSCII letters turned
+  // into lower case ASCII.
+  static std::string fileName(const uint8_t *RAM) {
+    std::string Name;
+    uint16_t Ptr = vector(RAM, 0xbb);
+    for (unsigned i = 0; i < RAM[0xb7]; i++) {
+      uint8_t C = RAM[(uint16_t)(Ptr + i)];
+      Name.push_back(C >= 'A' && C <= 'Z' ? C - 'A' + 'a' : C);
+    }
+    return Name;
+  }
+
+  // Case insensitive match of a CBM DOS pattern, '*' matches the rest of the
+  // name and '?' any single character.
+  static bool match(const char *Pattern, const char *Name) {
+    for (; *Pattern; Pattern++, Name++) {
+      if (*Pattern == '*')
+        return true;
+      if (!*Name ||
+          (*Pattern != '?' && tolower(*Pattern) != tolower(*Name)))
+        return false;
+    }
+    return !*Name;
+  }
+
+  // Look for Name, or Name.prg, in the directory. The first match in
+  // alphabetical order wins so that wildcards are deterministic.
+  bool findFile(const std::string &Name, std::string &Path) const {
+    if (Name.empty() || Name[0] == '$')
+      return false;
+    std::vector<std::string> Matches;
+    if (DIR *D = opendir(m_Dir.c_str())) {
+      while (struct dirent *E = readdir(D)) {
+        std::string Entry = E->d_name;
+        std::string Stem = Entry;
+        if (Stem.size() > 4 &&
+            !strcasecmp(Stem.c_str() + Stem.size() - 4, ".prg"))
+          Stem.resize(Stem.size() - 4);
+        if (Entry[0] != '.' &&
+            (match(Name.c_str(), Entry.c_str()) ||
+             match(Name.c_str(), Stem.c_str())))
+          Matches.push_back(Entry);
+      }
+      closedir(D);
+    }
+    if (Matches.empty())
+      return false;
+    std::sort(Matches.begin(), Matches.end());
+    Path = m_Dir + "/" + Matches[0];
+    return true;
+  }
+
+  std::string m_Dir;
+};
@@ -19,23 +19,69 @@
  */
 
 #include "Vmyc64_top.h"
+#include "Vmyc64_top___024root.h"
+#include "Vmyc64_top_cpu.h"
+#include "Vmyc64_top_cpu6510.h"
 #include "Vmyc64_top_myc64_top.h"
 #include "Vmyc64_top_spram2phase__A10_D8.h"
 #include "Vmyc64_top_spram2phase__D4.h"
 #include "Vmyc64_top_spram__A10_D8.h"
 #include "Vmyc64_top_spram__D4.h"
+#include "Vmyc64_top_sprom2phase__Ac_D8.h"
+#include "Vmyc64_top_sprom2phase__Ad_D8.h"
+#include "Vmyc64_top_sprom__Ac_D8.h"
+#include "Vmyc64_top_sprom__Ad_D8.h"
+#include "audio-decimator.h"
+#include "bus-trigger.h"
+#include "cpu-profiler.h"
+#include "debug-monitor.h"
+#include "flight-recorder.h"
+#include "frame-capture.h"
+#include "frame-pacer.h"
+#include "input-log.h"
+#include "kernal-trap.h"
+#include "perf-stats.h"
+#include "png-writer.h"
+#include "rewind-buffer.h"
+#include "rom-image.h"
+#include "shm-frame.h"
+#include "spsc-queue.h"
+#include "state-hash.h"
+#include "trace-control.h"
+#include "triple-buffer.h"
+#include "video-writer.h"
+#include "wav-writer.h"
 #include "verilated.h"
-#include "verilated_vcd_c.h"
+#include "verilated_save.h"
 #include <assert.h>
+#include <atomic>
 #include <cairo.h>
+#include <chrono>
+#include <deque>
 #include <fstream>
 #include <gdk/gdkkeysyms.h>
 #include <gtk/gtk.h>
-#include <list>
+#include <inttypes.h>
+#include <algorithm>
 #include <map>
+#include <memory>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// The model takes eight clocks per CPU cycle, a PAL C64 does 985248 CPU
+// cycles per second (312 lines of 63 cycles, i.e. 50.125 frames per second).
+// Machine::Cycle counts model clocks.
+static const unsigned CpuHz = 985248;
+static const unsigned CpuCyclesPerFrame = 312 * 63;
+static const double ModelClockHz = 8.0 * CpuHz;
 
 #define XRES 403
 #define YRES 284
@@ -45,30 +91,371 @@ static const struct {
   uint8_t PAIdx;
   uint8_t PBIdx;
   uint16_t KeyCode;
+  uint8_t PETSCII;
+  uint8_t ShiftedPETSCII;
 } KeyInfo[] = {
-#define DEF_KEY(a, b, c, d) {a, b, c, d},
+#define DEF_KEY(a, b, c, d, e, f) {a, b, c, d, e, f},
 #include "keys.def"
 #undef DEF_KEY
 };
 
-static Vmyc64_top *dut = NULL;
-static VerilatedVcdC *trace = NULL;
-static unsigned TraceTick = 0;
-static unsigned Cycle = 0;
-static const char *InjectKeyStringPtr = nullptr;
+struct Machine;
+
+// When a command runs, given as the part before the first ':' of a --cmd-*
+// option:
+//   <FRAME>                   at the end of frame <FRAME>
+//   cycle=<N>                 before cycle <N>
+//   pc=<ADDR>[+<N>]           when the CPU fetches an opcode at <ADDR>
+//   mem=<ADDR>=<VAL>[+<N>]    when RAM at <ADDR> holds <VAL>
+// For the conditions +<N> defers the command to the end of the N:th frame
+// after the condition was met.
+struct CommandWhen {
+  enum Kind { Frame, Cycle, PC, Mem };
+  Kind m_Kind = Frame;
+  // Frame, cycle or address depending on m_Kind.
+  uint64_t m_Value = 0;
+  uint8_t m_Data = 0;
+  int m_Delay = 0;
+};
+
+struct Command {
+  virtual ~Command() {}
+  virtual void execute(Machine &M) = 0;
+  CommandWhen m_When;
+  // Frame at the end of which the command runs, -1 while it still waits for
+  // its cycle or condition.
+  int m_DueFrame = -1;
+  // Order of scheduling, breaks ties so that commands due at the same time
+  // run in the order they were given.
+  uint64_t m_Seq = 0;
+  // The command line argument this command was created from. Kept so that
+  // pending commands can be written to (and re-parsed from) a state file.
+  std::string m_Arg;
+};
+
+// Keeps the pending commands of a machine. Commands due at a frame or cycle
+// are kept in heaps ordered by when they are due, the ones waiting on a
+// condition are checked on every CPU cycle. Any number of commands can run
+// at the same frame (or cycle).
+class CommandScheduler {
+public:
+  ~CommandScheduler() { clear(); }
+
+  void clear() {
+    for (Command *Cmd : pending())
+      delete Cmd;
+    m_ByFrame.clear();
+    m_ByCycle.clear();
+    m_Conditions.clear();
+  }
+
+  void add(Command *Cmd) {
+    Cmd->m_Seq = m_NextSeq++;
+    if (Cmd->m_DueFrame >= 0) {
+      pushHeap(m_ByFrame, Cmd);
+      return;
+    }
+    switch (Cmd->m_When.m_Kind) {
+    case CommandWhen::Frame:
+      Cmd->m_DueFrame = Cmd->m_When.m_Value;
+      pushHeap(m_ByFrame, Cmd);
+      break;
+    case CommandWhen::Cycle:
+      pushHeap(m_ByCycle, Cmd);
+      break;
+    case CommandWhen::PC:
+    case CommandWhen::Mem:
+      m_Conditions.push_back(Cmd);
+      break;
+    }
+  }
+
+  // True if cycle() needs to be called before every cycle.
+  bool watching() const { return !m_ByCycle.empty() || !m_Conditions.empty(); }
+
+  void cycle(Machine &M);
+  void frame(Machine &M);
+
+  // All pending commands in no particular order, they stay owned by the
+  // scheduler.
+  std::vector<Command *> pending() const {
+    std::vector<Command *> All(m_ByFrame);
+    All.insert(All.end(), m_ByCycle.begin(), m_ByCycle.end());
+    All.insert(All.end(), m_Conditions.begin(), m_Conditions.end());
+    return All;
+  }
+
+private:
+  // Min-heaps on the due frame or cycle.
+  static bool later(const Command *A, const Command *B) {
+    uint64_t DueA = A->m_DueFrame >= 0 ? A->m_DueFrame : A->m_When.m_Value;
+    uint64_t DueB = B->m_DueFrame >= 0 ? B->m_DueFrame : B->m_When.m_Value;
+    return DueA != DueB ? DueA > DueB : A->m_Seq > B->m_Seq;
+  }
+  static void pushHeap(std::vector<Command *> &Heap, Command *Cmd) {
+    Heap.push_back(Cmd);
+    std::push_heap(Heap.begin(), Heap.end(), later);
+  }
+  static Command *popHeap(std::vector<Command *> &Heap) {
+    std::pop_heap(Heap.begin(), Heap.end(), later);
+    Command *Cmd = Heap.back();
+    Heap.pop_back();
+    return Cmd;
+  }
+  void fired(Machine &M, Command *Cmd);
+
+  std::vector<Command *> m_ByFrame;
+  std::vector<Command *> m_ByCycle;
+  std::vector<Command *> m_Conditions;
+  uint64_t m_NextSeq = 0;
+};
+
+// The model is built without ROM contents, every Machine gets these.
+static RomImage KernalROM, BasicROM, CharROM;
+
+// Host time accounting for --stats, only done for the main machine and only
+// touched by the thread simulating it. The GTK redraws on the UI thread are
+// summed in DrawTicks and DrawCalls and handed over when reporting.
+static PerfStats *Stats;
+static std::atomic<uint64_t> DrawTicks(0), DrawCalls(0);
+static struct {
+  unsigned Eval, ClkCb, Commands, Output, Draw;
+  unsigned Cycles, Frames;
+} StatIds;
 
-struct CommandAtFrame {
-  CommandAtFrame(int FrameIdx) : m_FrameIdx(FrameIdx) {}
-  virtual void execute() = 0;
+struct RAMDump {
   int m_FrameIdx;
+  uint16_t m_Address;
+  std::vector<uint8_t> m_Data;
+};
+
+// One simulated C64. Everything that changes while simulating lives here so
+// that several machines can run side by side on different threads.
+struct Machine {
+  // Trace must be set for the model to be traceable, see traceEverOn().
+  Machine(bool Trace = false)
+      : Context(new VerilatedContext), Raster(XRES, YRES, 70, 10),
+        RGBFrame(XRES, YRES) {
+    Context->traceEverOn(Trace);
+    dut = new Vmyc64_top(Context.get());
+    Vmyc64_top_myc64_top *Top = top();
+    KernalROM.copyTo(Top->u_rom_kernal->u_sprom->mem);
+    BasicROM.copyTo(Top->u_rom_basic->u_sprom->mem);
+    CharROM.copyTo(Top->u_rom_char->u_sprom->mem);
+  }
+  ~Machine() {
+    dut->final();
+    delete dut;
+    delete Recorder;
+    delete Drive8;
+    delete Profile;
+    delete InputRec;
+    delete InputReplay;
+    delete Hashes;
+  }
+
+  // The myc64_top instance, found under the model's root since Verilator
+  // 4.210.
+  Vmyc64_top_myc64_top *top() const { return dut->rootp->myc64_top; }
+
+  uint8_t *mainRAM() { return top()->u_ram_main->u_spram->mem; }
+
+  // True once the model has executed $finish.
+  bool finished() const { return Context->gotFinish(); }
+
+  // The last frame in RGB, only expanded from the color indices when asked
+  // for.
+  FrameBuffer &rgbFrame() {
+    if (!RGBFrameValid) {
+      Colors.expand(Raster.frame(), RGBFrame);
+      RGBFrameValid = true;
+    }
+    return RGBFrame;
+  }
+
+  // True if a CPU bus cycle completes on the coming rising edge, i.e. the
+  // CPU has RDY.
+  bool cpuCycle() const {
+    return top()->clk_1mhz_ph1_en && top()->vic_ba;
+  }
+
+  // The address of the opcode that is being decoded or -1 if the CPU is in
+  // the middle of an instruction. Only meaningful when cpuCycle().
+  int opcodeAddr() const {
+    // In the DECODE state the opcode has just been fetched from PC - 1.
+    static const unsigned DECODE = 12;
+    Vmyc64_top_cpu *CPU = top()->u_cpu->u_cpu;
+    return CPU->state == DECODE ? (uint16_t)(CPU->PC - 1) : -1;
+  }
+
+  void tick() {
+    if (InputReplay && InputReplay->nextCycle() == Cycle)
+      replayInput();
+    if (InputRec && dut->i_keyboard_mask != RecordedMask) {
+      RecordedMask = dut->i_keyboard_mask;
+      InputRec->change(Cycle, RecordedMask);
+    }
+    if (Scheduler.watching())
+      Scheduler.cycle(*this);
+    if (Drive8 && cpuCycle()) {
+      int OpcodeAddr = opcodeAddr();
+      if (OpcodeAddr == KernalDiskTrap::loadTrap())
+        Drive8->load(mainRAM());
+      else if (OpcodeAddr == KernalDiskTrap::saveTrap())
+        Drive8->save(mainRAM());
+    }
+    if (Recorder)
+      recordBusCycle();
+    if (Profile && top()->clk_1mhz_ph1_en)
+      Profile->cycle(cpuCycle() ? opcodeAddr() : -1);
+    if (TraceCtl)
+      updateTrace();
+    // XXX: Need additional call to eval() see
+    // https://zipcpu.com/blog/2018/09/06/tbclock.html
+    dut->clk = 1;
+    dut->eval();
+    if (Tracing)
+      trace->dump(2 * (uint64_t)Cycle);
+    dut->clk = 0;
+    dut->eval();
+    if (Tracing)
+      trace->dump(2 * (uint64_t)Cycle + 1);
+    Cycle++;
+  }
+
+  // Decide whether the coming cycle is traced. The trace file is opened when
+  // tracing first starts and closed when the window has passed, after which
+  // TraceCtl is dropped and tick() runs at full speed again.
+  void updateTrace() {
+    if (TraceCtl->waitingForTrigger()) {
+      Vmyc64_top_myc64_top *Top = top();
+      if (Top->clk_1mhz_ph1_en && Top->vic_ba)
+        TraceCtl->busCycle(Cycle, Top->cpu_addr, Top->cpu_do, Top->cpu_we);
+    }
+    if (TraceCtl->finished(Cycle, FrameIdx + 1)) {
+      if (trace) {
+        trace->close();
+        delete trace;
+        trace = nullptr;
+        fprintf(stderr, "Trace closed at cycle %" PRIu64 "\n", Cycle);
+      }
+      TraceCtl = nullptr;
+      Tracing = false;
+      return;
+    }
+    Tracing = TraceCtl->active(Cycle, FrameIdx + 1);
+    if (Tracing && !trace) {
+      trace = new TraceFile;
+      dut->trace(trace, 99);
+      trace->open(TracePath);
+      fprintf(stderr, "Trace opened at cycle %" PRIu64 "\n", Cycle);
+    }
+  }
+
+  void reset() {
+    // Apply five cycles with reset active.
+    dut->rst = 1;
+    for (unsigned i = 0; i < 5; i++)
+      tick();
+    dut->rst = 0;
+  }
+
+  // Called before each rising edge, a CPU bus cycle completes on the edges
+  // where clk_1mhz_ph1_en is high.
+  void recordBusCycle() {
+    Vmyc64_top_myc64_top *Top = top();
+    if (!Top->clk_1mhz_ph1_en)
+      return;
+    uint8_t Flags = (Top->cpu_we ? FlightRecorder::WE : 0) |
+                    (Top->vic_ba ? FlightRecorder::VicBA : 0) |
+                    (Top->vic_cs ? FlightRecorder::VicCS : 0) |
+                    (Top->sid_cs ? FlightRecorder::SidCS : 0) |
+                    (Top->color_cs ? FlightRecorder::ColorCS : 0) |
+                    (Top->cia1_cs ? FlightRecorder::Cia1CS : 0) |
+                    (Top->cia1_irq ? FlightRecorder::IRQ : 0);
+    Recorder->record(Cycle, Top->cpu_addr, Top->cpu_do, Top->cpu_di, Flags);
+    if (RecorderTrigger.match(Top->cpu_addr, Top->cpu_do, Top->cpu_we)) {
+      // Only the first hit, later ones would overwrite the interesting part.
+      RecorderTrigger = BusTrigger();
+      dumpRecorder();
+    }
+  }
+
+  void replayInput() {
+    while (InputReplay->pending() && InputReplay->nextCycle() == Cycle)
+      dut->i_keyboard_mask = InputReplay->next();
+    if (!InputReplay->pending()) {
+      fprintf(stderr, "Input replay finished at cycle %" PRIu64 "\n",
+              Cycle);
+      delete InputReplay;
+      InputReplay = nullptr;
+    }
+  }
+
+  void dumpRecorder();
+  int clk_cb();
+  void injectKeys();
+  void typeKeys();
+  bool step();
+  bool simulateFrame();
+
+  // Each machine has a context of its own so that a $finish in one of them
+  // does not stop the others.
+  std::unique_ptr<VerilatedContext> Context;
+  Vmyc64_top *dut = nullptr;
+  // Trace time is in half cycles so that windows line up with Cycle.
+  TraceFile *trace = nullptr;
+  TraceControl *TraceCtl = nullptr;
+  const char *TracePath = TRACE_FILE_DEFAULT;
+  bool Tracing = false;
+  // Flight recorder, written to <RecorderPrefix>-<Cycle>.vcd (or .bin).
+  FlightRecorder *Recorder = nullptr;
+  BusTrigger RecorderTrigger;
+  std::string RecorderPrefix;
+  bool RecorderBinary = false;
+  uint64_t Cycle = 0;
+  int FrameIdx = -1;
+  // The video output is captured as color indices.
+  IndexedRasterCapture Raster;
+  FrameBuffer RGBFrame;
+  bool RGBFrameValid = false;
+  Palette Colors;
+  // Keys left to inject, points into InjectKeyString.
+  std::string InjectKeyString;
+  const char *InjectKeyStringPtr = nullptr;
+  int KeyWaitFrameIdx = 0;
+  // PETSCII waiting to be put in the KERNAL keyboard buffer.
+  std::string TypeKeys;
+  // Serves LOAD/SAVE on device 8 from a host directory.
+  KernalDiskTrap *Drive8 = nullptr;
+  // Where the 6502 spends its cycles, for --profile.
+  CpuProfiler *Profile = nullptr;
+  // Keyboard mask changes are logged to InputRec and/or played back from
+  // InputReplay, see input-log.h.
+  InputLogWriter *InputRec = nullptr;
+  uint64_t RecordedMask = 0;
+  InputLogReader *InputReplay = nullptr;
+  CommandScheduler Scheduler;
+  // Hashes of the current frame, the audio part is accumulated per cycle.
+  FrameHash *Hashes = nullptr;
+  WAVWriter *Audio = nullptr;
+  AudioDecimator *AudioFilter = nullptr;
+  // Charge time to the global Stats.
+  bool CollectStats = false;
+  // When set CommandDumpRAM records into RAMDumps instead of printing.
+  bool CollectRAMDumps = false;
+  std::vector<RAMDump> RAMDumps;
 };
 
-struct CommandLoadPRG : public CommandAtFrame {
-  CommandLoadPRG(int FrameIdx, const char *PathToPRG)
-      : CommandAtFrame(FrameIdx), m_PathToPRG(PathToPRG) {}
-  void execute() override {
-    uint8_t *RAM = dut->myc64_top->u_ram_main->u_spram->mem;
-    FILE *fp = fopen(m_PathToPRG, "rb");
+struct CommandLoadPRG : public Command {
+  CommandLoadPRG(const char *PathToPRG) : m_PathToPRG(PathToPRG) {}
+  void execute(Machine &M) override {
+    uint8_t *RAM = M.mainRAM();
+    FILE *fp = fopen(m_PathToPRG.c_str(), "rb");
+    if (!fp) {
+      fprintf(stderr, "Unable to open '%s'\n", m_PathToPRG.c_str());
+      exit(1);
+    }
     fseek(fp, 0, SEEK_END);
     uint16_t PrgSize = ftell(fp) - sizeof(uint16_t);
     rewind(fp);
@@ -93,14 +480,23 @@ struct CommandLoadPRG : public CommandAtFrame {
     RAM[0x2d] = RAM[0x2f] = RAM[0x31] = RAM[0xae] = PrgEndAddr & 0xff;
     RAM[0x2e] = RAM[0x30] = RAM[0x32] = RAM[0xaf] = PrgEndAddr >> 8;
   }
-  const char *m_PathToPRG;
+  std::string m_PathToPRG;
 };
 
-struct CommandDumpRAM : public CommandAtFrame {
-  CommandDumpRAM(int FrameIdx, uint16_t Address, uint16_t Size)
-      : CommandAtFrame(FrameIdx), m_Address(Address), m_Size(Size) {}
-  void execute() override {
-    uint8_t *p = dut->myc64_top->u_ram_main->u_spram->mem;
+struct CommandDumpRAM : public Command {
+  CommandDumpRAM(uint16_t Address, uint16_t Size)
+      : m_Address(Address), m_Size(Size) {}
+  void execute(Machine &M) override {
+    uint8_t *p = M.mainRAM();
+    if (M.CollectRAMDumps) {
+      RAMDump Dump;
+      Dump.m_FrameIdx = M.FrameIdx;
+      Dump.m_Address = m_Address;
+      for (uint16_t i = 0; i < m_Size; i++)
+        Dump.m_Data.push_back(p[(uint16_t)(m_Address + i)]);
+      M.RAMDumps.push_back(Dump);
+      return;
+    }
     for (uint16_t i = 0; i < m_Size; i++) {
       if (i % 16 == 0)
         printf("\n%04x: ", m_Address + i);
@@ -113,109 +509,171 @@ struct CommandDumpRAM : public CommandAtFrame {
   uint16_t m_Size;
 };
 
-struct CommandInjectKeys : public CommandAtFrame {
-  CommandInjectKeys(int FrameIdx, const char *Keys)
-      : CommandAtFrame(FrameIdx), m_Keys(Keys) {}
-  void execute() override { InjectKeyStringPtr = m_Keys; }
-  const char *m_Keys;
+struct CommandInjectKeys : public Command {
+  CommandInjectKeys(const char *Keys) : m_Keys(Keys) {}
+  void execute(Machine &M) override {
+    M.InjectKeyString = m_Keys;
+    M.InjectKeyStringPtr = M.InjectKeyString.c_str();
+  }
+  std::string m_Keys;
 };
 
-std::list<CommandAtFrame *> Commands;
+// Translate keys given as for --cmd-inject-keys to PETSCII, a <LSHIFT> or
+// <RSHIFT> applies to the key that follows. Returns false on unknown keys.
+static bool keys_to_petscii(const char *Keys, std::string &Out) {
+  bool Shift = false;
+  while (*Keys) {
+    int Key = -1;
+    for (int i = 0; i < sizeof(KeyInfo) / sizeof(KeyInfo[0]); i++) {
+      size_t KeyLen = strlen(KeyInfo[i].C64Key);
+      if (!strncmp(Keys, KeyInfo[i].C64Key, KeyLen)) {
+        Key = i;
+        Keys += KeyLen;
+        break;
+      }
+    }
+    if (Key < 0)
+      return false;
+    if (!strcmp("<LSHIFT>", KeyInfo[Key].C64Key) ||
+        !strcmp("<RSHIFT>", KeyInfo[Key].C64Key)) {
+      Shift = true;
+      continue;
+    }
+    uint8_t C = Shift ? KeyInfo[Key].ShiftedPETSCII : KeyInfo[Key].PETSCII;
+    if (!C)
+      return false;
+    Out.push_back(C);
+    Shift = false;
+  }
+  return true;
+}
 
-GdkPixbuf *FramePixBuf;
-static int FrameIdx = -1;
-static std::vector<int16_t> SIDSamples;
+// Types by writing PETSCII straight into the KERNAL keyboard buffer rather
+// than pressing keys in the matrix, up to ten characters per frame instead
+// of two frames per key. The CIA scan is not exercised.
+struct CommandTypeKeys : public Command {
+  CommandTypeKeys(const std::string &PETSCII) : m_PETSCII(PETSCII) {}
+  void execute(Machine &M) override { M.TypeKeys += m_PETSCII; }
+  std::string m_PETSCII;
+};
 
 static struct {
   int scale;
   int frame_rate;
+  bool realtime;
   int save_frame_from;
   int save_frame_to;
+  int save_frame_every;
   const char *save_frame_prefix;
+  int png_threads;
+  const char *video_out;
+  const char *shm_frame;
+  const char *monitor_socket;
+  VideoWriter::Format video_format;
+  const char *palette;
+  const char *rom_kernal;
+  const char *rom_basic;
+  const char *rom_char;
+  const char *wav_out;
+  int audio_rate;
+  bool bench_audio;
+  bool stats;
+  int stats_every;
+  const char *stats_json;
+  const char *profile_file;
+  const char *profile_frames_file;
+  const char *profile_labels;
+  unsigned profile_top;
   int exit_after_frame;
   bool trace;
+  TraceControl trace_ctl;
+  const char *trace_file;
+  const char *drive8_dir;
+  const char *record_input;
+  const char *hash_log;
+  unsigned rewind_seconds;
+  unsigned rewind_mb;
+  const char *hash_golden;
+  const char *replay_input;
+  unsigned flight_recorder;
+  bool flight_recorder_binary;
+  const char *flight_recorder_prefix;
+  BusTrigger flight_recorder_trigger;
+  bool headless;
+  int save_state_frame;
+  const char *save_state_file;
+  const char *load_state_file;
+  const char *run_jobs_file;
+  int fork_frame;
+  const char *report_file;
+  int num_threads;
 } options;
 
-static void saveWAV(std::vector<int16_t> &pcmSamples) {
-  FILE *fp;
-  fp = fopen("out.wav", "wb");
-
-  char ChunkID[] = {'R', 'I', 'F', 'F'};
-  uint32_t ChunkSize = 0;
-  char Format[] = {'W', 'A', 'V', 'E'};
-
-  char Subchunk1ID[] = {'f', 'm', 't', ' '};
-  uint32_t Subchunk1Size = 16;
-  uint16_t AudioFormat = 1;
-  uint16_t NumChannels = 1;
-  uint32_t SampleRate = 50000;
-  uint16_t BitsPerSample = 16;
-  uint32_t ByteRate = SampleRate * NumChannels * BitsPerSample / 8;
-  uint16_t BlockAlign = NumChannels * BitsPerSample / 8;
-
-  char Subchunk2ID[] = {'d', 'a', 't', 'a'};
-  uint32_t Subchunk2Size = pcmSamples.size() * NumChannels * BitsPerSample / 8;
-  ChunkSize = 36 + Subchunk2Size;
-
-  // RIFF chunk descriptor.
-  fwrite(&ChunkID[0], sizeof(ChunkID), 1, fp);
-  fwrite(&ChunkSize, sizeof(ChunkSize), 1, fp);
-  fwrite(&Format, sizeof(Format), 1, fp);
-
-  // fmt sub-chunk.
-  fwrite(&Subchunk1ID[0], sizeof(Subchunk1ID), 1, fp);
-  fwrite(&Subchunk1Size, sizeof(Subchunk1Size), 1, fp);
-  fwrite(&AudioFormat, sizeof(AudioFormat), 1, fp);
-  fwrite(&NumChannels, sizeof(NumChannels), 1, fp);
-  fwrite(&SampleRate, sizeof(SampleRate), 1, fp);
-  fwrite(&ByteRate, sizeof(ByteRate), 1, fp);
-  fwrite(&BlockAlign, sizeof(BlockAlign), 1, fp);
-  fwrite(&BitsPerSample, sizeof(BitsPerSample), 1, fp);
-
-  // data sub-chunk
-  fwrite(&Subchunk2ID[0], sizeof(Subchunk2ID), 1, fp);
-  fwrite(&Subchunk2Size, sizeof(Subchunk2Size), 1, fp);
-
-  long NextDataPos = ftell(fp);
-  for (unsigned i = 0; i < pcmSamples.size(); i++)
-    fwrite(&pcmSamples[i], sizeof(int16_t), 1, fp);
-
-  fclose(fp);
-}
-
-static void put_pixel(GdkPixbuf *pixbuf, int x, int y, guchar red, guchar green,
-                      guchar blue) {
-  int width, height, rowstride, n_channels;
-  guchar *pixels, *p;
-
-  n_channels = gdk_pixbuf_get_n_channels(pixbuf);
-
-  g_assert(gdk_pixbuf_get_colorspace(pixbuf) == GDK_COLORSPACE_RGB);
-  g_assert(gdk_pixbuf_get_bits_per_sample(pixbuf) == 8);
-  g_assert(!gdk_pixbuf_get_has_alpha(pixbuf));
-  g_assert(n_channels == 3);
-
-  width = gdk_pixbuf_get_width(pixbuf);
-  height = gdk_pixbuf_get_height(pixbuf);
-
-  g_assert(x >= 0 && x < width);
-  g_assert(y >= 0 && y < height);
+static const char *ProgName;
+
+// Set by SIGUSR1, asks for the flight recorder to be written.
+static volatile sig_atomic_t FlightRecorderDumpRequested = 0;
+
+static void on_sigusr1(int) { FlightRecorderDumpRequested = 1; }
+
+static std::chrono::steady_clock::time_point SimStartTime;
+
+static GtkWidget *MainWindow;
+
+static PNGWriter *FrameWriter;
+// Only with --realtime.
+static FramePacer *Pacer;
+static FrameHashLog *HashLog;
+// The last few seconds of the main machine for --rewind.
+static RewindBuffer *Rewind;
+
+static void rewind(Machine &M, int Frames);
+static VideoWriter VideoOut;
+static ShmFrameWriter *ShmOut;
+static DebugMonitor *Monitor;
+static FILE *ProfileFrames;
+// Set by the monitor Stop request, the simulation then only runs the cycles
+// that the monitor asks for.
+static bool MonitorStopped;
+// The viewer keyboard as last applied, only changes are passed on so that
+// the window and --cmd-inject-keys keep working while a viewer is attached.
+static uint64_t ShmViewerMask;
+
+// With a window the main machine runs on a thread of its own so that neither
+// side has to wait for the other. Finished frames are handed to the GTK main
+// loop through Display, the UI draws whatever is newest there. Key events
+// go the other way through UIEvents and are applied between frames.
+struct DisplayFrame {
+  DisplayFrame() : RGB(XRES, YRES) {}
+  FrameBuffer RGB;
+  // Wraps the memory of RGB, created on the GTK main thread.
+  GdkPixbuf *PixBuf = nullptr;
+  int FrameIdx = 0;
+  uint64_t KeyboardMask = 0;
+};
 
-  rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-  pixels = gdk_pixbuf_get_pixels(pixbuf);
+struct UIEvent {
+  enum { KeyDown, KeyUp, Rewind } Kind;
+  uint64_t Mask;
+  int Frames;
+};
 
-  p = pixels + y * rowstride + x * n_channels;
-  p[0] = red;
-  p[1] = green;
-  p[2] = blue;
-}
+static TripleBuffer<DisplayFrame> Display;
+static SPSCQueue<UIEvent, 256> UIEvents;
+// Set while a redraw is queued on the main loop, avoids queuing one per frame
+// when the UI falls behind.
+static std::atomic<bool> DrawPending(false);
+static std::atomic<bool> SimQuit(false);
 
 static gboolean on_draw_event(GtkWidget *widget, cairo_t *cr,
                               gpointer user_data) {
   (void)widget;
   (void)user_data;
+  uint64_t T0 = Stats ? PerfStats::now() : 0;
+  Display.acquire();
+  const DisplayFrame &F = Display.front();
   cairo_scale(cr, options.scale, options.scale);
-  gdk_cairo_set_source_pixbuf(cr, FramePixBuf, 0.0, 0.0);
+  gdk_cairo_set_source_pixbuf(cr, F.PixBuf, 0.0, 0.0);
   cairo_paint(cr);
   cairo_fill(cr);
 
@@ -227,26 +685,41 @@ static gboolean on_draw_event(GtkWidget *widget, cairo_t *cr,
   cairo_set_source_rgb(cr, 255, 255, 255);
   cairo_move_to(cr, 10, 15);
   char buf[64];
-  snprintf(buf, sizeof(buf), "Frame #%03d, KeyboardMask=0x%016lx", FrameIdx,
-           dut->i_keyboard_mask);
+  snprintf(buf, sizeof(buf), "Frame #%03d, KeyboardMask=0x%016lx", F.FrameIdx,
+           F.KeyboardMask);
   cairo_show_text(cr, buf);
 
+  if (Stats) {
+    DrawTicks += PerfStats::now() - T0;
+    DrawCalls++;
+  }
+
   return FALSE;
 }
 
-static gboolean on_key_press(GtkWidget *widget, GdkEventKey *event,
-                             gpointer user_data) {
-  (void)widget;
-  (void)user_data;
+static uint64_t key_mask(guint16 KeyCode) {
   for (int i = 0; i < sizeof(KeyInfo) / sizeof(KeyInfo[0]); i++) {
-    if (KeyInfo[i].KeyCode == event->hardware_keycode) {
+    if (KeyInfo[i].KeyCode == KeyCode) {
       int pa = KeyInfo[i].PAIdx;
       int pb = KeyInfo[i].PBIdx;
-      uint64_t mask = 1ULL << (pa * 8 + pb);
-      dut->i_keyboard_mask |= mask;
-      break;
+      return 1ULL << (pa * 8 + pb);
     }
   }
+  return 0;
+}
+
+static gboolean on_key_press(GtkWidget *widget, GdkEventKey *event,
+                             gpointer user_data) {
+  (void)widget;
+  (void)user_data;
+  // F9 steps back a second and F10 a single frame.
+  if (Rewind &&
+      (event->keyval == GDK_KEY_F9 || event->keyval == GDK_KEY_F10)) {
+    UIEvents.push({UIEvent::Rewind, 0, event->keyval == GDK_KEY_F9 ? 50 : 1});
+    return TRUE;
+  }
+  if (uint64_t Mask = key_mask(event->hardware_keycode))
+    UIEvents.push({UIEvent::KeyDown, Mask, 0});
   return FALSE;
 }
 
@@ -254,127 +727,682 @@ static gboolean on_key_release(GtkWidget *widget, GdkEventKey *event,
                                gpointer user_data) {
   (void)widget;
   (void)user_data;
-  for (int i = 0; i < sizeof(KeyInfo) / sizeof(KeyInfo[0]); i++) {
-    if (KeyInfo[i].KeyCode == event->hardware_keycode) {
-      int pa = KeyInfo[i].PAIdx;
-      int pb = KeyInfo[i].PBIdx;
-      uint64_t mask = 1ULL << (pa * 8 + pb);
-      dut->i_keyboard_mask &= ~mask;
-      break;
+  if (uint64_t Mask = key_mask(event->hardware_keycode))
+    UIEvents.push({UIEvent::KeyUp, Mask, 0});
+  return FALSE;
+}
+
+void Machine::dumpRecorder() {
+  char Path[256];
+  snprintf(Path, sizeof(Path), "%s-%" PRIu64 ".%s", RecorderPrefix.c_str(),
+           Cycle, RecorderBinary ? "bin" : "vcd");
+  bool Ok = RecorderBinary ? Recorder->writeBinary(Path)
+                           : Recorder->writeVCD(Path);
+  if (Ok)
+    fprintf(stderr, "Flight recorder written to '%s'\n", Path);
+  else
+    fprintf(stderr, "Unable to open '%s' for writing\n", Path);
+}
+
+int Machine::clk_cb() {
+  int frame_done = Raster.clock(dut->o_hsync, dut->o_vsync, dut->o_color_idx);
+
+  if (Audio) {
+    int16_t Sample;
+    if (AudioFilter->push(dut->o_wave, Sample))
+      Audio->write(Sample);
+  }
+
+  if (Hashes)
+    Hashes->addSample(dut->o_wave);
+
+  return frame_done;
+}
+
+void Machine::injectKeys() {
+  if (FrameIdx >= KeyWaitFrameIdx && InjectKeyStringPtr &&
+      *InjectKeyStringPtr != '\0') {
+    if (dut->i_keyboard_mask) {
+      dut->i_keyboard_mask = 0;
+      KeyWaitFrameIdx = FrameIdx + 1;
+    } else {
+      // Inject key press.
+      bool IsModifier;
+      do {
+        IsModifier = false;
+        size_t Rem = strlen(InjectKeyStringPtr);
+        for (int i = 0; i < sizeof(KeyInfo) / sizeof(KeyInfo[0]); i++) {
+          size_t KeyLen = strlen(KeyInfo[i].C64Key);
+          if (!strncmp(InjectKeyStringPtr, KeyInfo[i].C64Key,
+                       std::min<size_t>(Rem, KeyLen))) {
+            uint64_t mask = 1ULL << (KeyInfo[i].PAIdx * 8 + KeyInfo[i].PBIdx);
+            dut->i_keyboard_mask |= mask;
+            InjectKeyStringPtr += KeyLen;
+            KeyWaitFrameIdx = FrameIdx + 1;
+            if (!strcmp("<LSHIFT>", KeyInfo[i].C64Key) ||
+                !strcmp("<RSHIFT>", KeyInfo[i].C64Key))
+              IsModifier = true;
+            break;
+          }
+        }
+      } while (IsModifier);
+    }
+  }
+}
+
+void CommandScheduler::cycle(Machine &M) {
+  while (!m_ByCycle.empty() && m_ByCycle.front()->m_When.m_Value <= M.Cycle)
+    fired(M, popHeap(m_ByCycle));
+
+  if (m_Conditions.empty() || !M.cpuCycle())
+    return;
+  int OpcodeAddr = M.opcodeAddr();
+  uint8_t *RAM = M.mainRAM();
+  for (size_t i = 0; i < m_Conditions.size();) {
+    Command *Cmd = m_Conditions[i];
+    const CommandWhen &W = Cmd->m_When;
+    bool Met = W.m_Kind == CommandWhen::PC ? OpcodeAddr == (int)W.m_Value
+                                           : RAM[W.m_Value] == W.m_Data;
+    if (!Met) {
+      i++;
+      continue;
+    }
+    m_Conditions.erase(m_Conditions.begin() + i);
+    if (W.m_Delay) {
+      Cmd->m_DueFrame = M.FrameIdx + W.m_Delay;
+      pushHeap(m_ByFrame, Cmd);
+    } else {
+      fired(M, Cmd);
     }
   }
-  return FALSE;
 }
 
-int clk_cb() {
-  static int hcntr = 0;
-  static int vcntr = 0;
+void CommandScheduler::frame(Machine &M) {
+  while (!m_ByFrame.empty() && m_ByFrame.front()->m_DueFrame <= M.FrameIdx)
+    fired(M, popHeap(m_ByFrame));
+}
 
-  int frame_done = 0;
+void CommandScheduler::fired(Machine &M, Command *Cmd) {
+  Cmd->execute(M);
+  delete Cmd;
+}
 
-  if (dut->o_hsync) {
-    hcntr = 0;
-    vcntr++;
+// Refill the KERNAL keyboard buffer at $0277 (length at $c6, capacity at
+// $0289) from TypeKeys. The buffer is only written once the KERNAL has
+// drained it so there is no risk of racing with it removing a character.
+void Machine::typeKeys() {
+  uint8_t *RAM = mainRAM();
+  if (TypeKeys.empty() || RAM[0xc6] != 0)
+    return;
+  size_t Capacity = RAM[0x289] && RAM[0x289] <= 10 ? RAM[0x289] : 10;
+  size_t N = std::min(TypeKeys.size(), Capacity);
+  memcpy(&RAM[0x277], TypeKeys.data(), N);
+  RAM[0xc6] = N;
+  TypeKeys.erase(0, N);
+}
+
+// Simulate a single cycle, returns true if it completed a frame.
+bool Machine::step() {
+  uint64_t T0 = CollectStats ? PerfStats::now() : 0;
+  tick();
+  uint64_t T1 = CollectStats ? PerfStats::now() : 0;
+  int FrameDone = clk_cb();
+  if (CollectStats) {
+    uint64_t T2 = PerfStats::now();
+    Stats->charge(StatIds.Eval, T1 - T0);
+    Stats->charge(StatIds.ClkCb, T2 - T1);
   }
-  if (dut->o_vsync) {
-    vcntr = 0;
-    frame_done = 1;
+  if (!FrameDone)
+    return false;
+
+  T0 = CollectStats ? PerfStats::now() : 0;
+  FrameIdx++;
+  Scheduler.frame(*this);
+  injectKeys();
+  typeKeys();
+  if (Drive8)
+    Drive8->install(mainRAM());
+  if (CollectStats)
+    Stats->charge(StatIds.Commands, PerfStats::now() - T0);
+  // The next frame starts here.
+  RGBFrameValid = false;
+  return true;
+}
+
+bool Machine::simulateFrame() {
+  while (!finished()) {
+    if (step())
+      return true;
   }
+  return false;
+}
+
+static Command *parse_command(const char *Arg);
+
+// State file layout: the fixed size StateHeader, the argument strings of the
+// pending commands (each followed by its due frame if its condition already
+// was met), the not yet injected keys, the not yet typed PETSCII and finally
+// the Verilated model itself (requires verilator --savable).
+struct StateHeader {
+  char Magic[8];
+  uint32_t Version;
+  int32_t FrameIdx;
+  uint64_t Cycle;
+  int32_t HCntr;
+  int32_t VCntr;
+  int32_t KeyWaitFrameIdx;
+  uint32_t NumCommands;
+  uint32_t InjectKeysLen;
+  uint32_t TypeKeysLen;
+};
+
+static const char StateMagic[8] = {'M', 'Y', 'C', '6', '4', 'S', 'T', 'A'};
+static const uint32_t StateVersion = 5;
 
-  int hcntr_shifted = hcntr - 70;
-  int vcntr_shifted = vcntr - 10;
-  if (0 <= hcntr_shifted && hcntr_shifted < XRES && 0 <= vcntr_shifted &&
-      vcntr_shifted < YRES) {
-    guchar red = dut->o_color_rgb >> 16;
-    guchar green = dut->o_color_rgb >> 8;
-    guchar blue = dut->o_color_rgb & 0xff;
-    put_pixel(FramePixBuf, hcntr_shifted, vcntr_shifted, red, green, blue);
+static void writeStateString(VerilatedSerialize &os, const char *Str) {
+  uint32_t Len = strlen(Str);
+  os.write(&Len, sizeof(Len));
+  os.write(Str, Len);
+}
+
+static std::string readStateString(VerilatedDeserialize &is) {
+  uint32_t Len;
+  is.read(&Len, sizeof(Len));
+  std::string Str(Len, '\0');
+  is.read(&Str[0], Len);
+  return Str;
+}
+
+static void writeState(Machine &M, VerilatedSerialize &os) {
+  const char *InjectKeys = M.InjectKeyStringPtr ? M.InjectKeyStringPtr : "";
+  StateHeader Hdr;
+  memcpy(Hdr.Magic, StateMagic, sizeof(Hdr.Magic));
+  Hdr.Version = StateVersion;
+  Hdr.Cycle = M.Cycle;
+  Hdr.FrameIdx = M.FrameIdx;
+  Hdr.HCntr = M.Raster.hcntr();
+  Hdr.VCntr = M.Raster.vcntr();
+  Hdr.KeyWaitFrameIdx = M.KeyWaitFrameIdx;
+  std::vector<Command *> Pending = M.Scheduler.pending();
+  Hdr.NumCommands = Pending.size();
+  Hdr.InjectKeysLen = strlen(InjectKeys);
+  Hdr.TypeKeysLen = M.TypeKeys.size();
+  os.write(&Hdr, sizeof(Hdr));
+
+  // Keep the order in which the commands were scheduled.
+  std::sort(Pending.begin(), Pending.end(),
+            [](const Command *A, const Command *B) {
+              return A->m_Seq < B->m_Seq;
+            });
+  for (Command *Cmd : Pending) {
+    int32_t DueFrame = Cmd->m_When.m_Kind == CommandWhen::Frame
+                           ? -1
+                           : Cmd->m_DueFrame;
+    writeStateString(os, Cmd->m_Arg.c_str());
+    os.write(&DueFrame, sizeof(DueFrame));
   }
+  writeStateString(os, InjectKeys);
+  os.write(M.TypeKeys.data(), Hdr.TypeKeysLen);
 
-  hcntr++;
+  os << *M.dut;
+}
 
-  // Sample at 50kHz but clock is 8Mhz.
-  if (Cycle % (20 * 8) == 0)
-    SIDSamples.push_back(dut->o_wave);
+// Returns false if the stream does not hold a compatible state.
+static bool readState(Machine &M, VerilatedDeserialize &is) {
+  StateHeader Hdr;
+  is.read(&Hdr, sizeof(Hdr));
+  if (memcmp(Hdr.Magic, StateMagic, sizeof(Hdr.Magic)) ||
+      Hdr.Version != StateVersion)
+    return false;
+  M.Cycle = Hdr.Cycle;
+  M.FrameIdx = Hdr.FrameIdx;
+  M.Raster.setPosition(Hdr.HCntr, Hdr.VCntr);
+  M.KeyWaitFrameIdx = Hdr.KeyWaitFrameIdx;
+
+  // Pending commands from the state file are scheduled first so that they
+  // run before commands given on the command line that are due at the same
+  // time.
+  for (uint32_t i = 0; i < Hdr.NumCommands; i++) {
+    Command *Cmd = parse_command(readStateString(is).c_str());
+    if (!Cmd)
+      return false;
+    int32_t DueFrame;
+    is.read(&DueFrame, sizeof(DueFrame));
+    Cmd->m_DueFrame = DueFrame;
+    M.Scheduler.add(Cmd);
+  }
 
-  return frame_done;
+  M.InjectKeyString = readStateString(is);
+  M.InjectKeyStringPtr =
+      Hdr.InjectKeysLen ? M.InjectKeyString.c_str() : nullptr;
+  M.TypeKeys.resize(Hdr.TypeKeysLen);
+  is.read(&M.TypeKeys[0], Hdr.TypeKeysLen);
+
+  is >> *M.dut;
+  return true;
 }
 
-static gboolean timeout_handler(GtkWidget *widget) {
-  while (!Verilated::gotFinish()) {
-    // XXX: Need additional call to eval() see
-    // https://zipcpu.com/blog/2018/09/06/tbclock.html
-    dut->clk = 1;
-    dut->eval();
-    if (trace)
-      trace->dump(TraceTick++);
-    dut->clk = 0;
-    dut->eval();
-    if (trace)
-      trace->dump(TraceTick++);
+static bool saveState(Machine &M, const char *Path) {
+  VerilatedSave os;
+  os.open(Path);
+  if (!os.isOpen()) {
+    fprintf(stderr, "Unable to open state file '%s' for writing\n", Path);
+    return false;
+  }
+  writeState(M, os);
+  os.close();
+  return true;
+}
 
-    Cycle++;
+static void loadState(Machine &M, const char *Path) {
+  VerilatedRestore is;
+  is.open(Path);
+  if (!is.isOpen()) {
+    fprintf(stderr, "Unable to open state file '%s' for reading\n", Path);
+    exit(1);
+  }
+  if (!readState(M, is)) {
+    fprintf(stderr, "'%s' is not a compatible state file\n", Path);
+    exit(1);
+  }
+  is.close();
+}
 
-    if (clk_cb()) {
-      FrameIdx++;
-      gtk_widget_queue_draw(widget);
+// Go back to the newest state that is at least Frames frames old and resume
+// from there. The input log can not follow a jump back in time so rewinding
+// is refused while recording or replaying one.
+static void rewind(Machine &M, int Frames) {
+  if (M.InputRec || M.InputReplay) {
+    fprintf(stderr, "Rewind is not possible while recording/replaying input\n");
+    return;
+  }
+  std::vector<uint8_t> State;
+  int Frame = Rewind->get(M.FrameIdx - Frames, State);
+  if (Frame < 0)
+    return;
+  MemoryRestore is(State);
+  // The pending commands are replaced by those of the older state.
+  M.Scheduler.clear();
+  if (!readState(M, is)) {
+    fprintf(stderr, "Unable to rewind to frame %d\n", Frame);
+    return;
+  }
+  // Resuming makes the newer frames history of another timeline.
+  Rewind->truncate(Frame);
+  fprintf(stderr, "Rewound to frame %d\n", Frame);
+}
 
-      if (!Commands.empty() && FrameIdx >= Commands.front()->m_FrameIdx) {
-        Commands.front()->execute();
-        Commands.pop_front();
-      }
-      static int KeyWaitFrameIdx = 0;
-      if (FrameIdx >= KeyWaitFrameIdx && InjectKeyStringPtr &&
-          *InjectKeyStringPtr != '\0') {
-        if (dut->i_keyboard_mask) {
-          dut->i_keyboard_mask = 0;
-          KeyWaitFrameIdx = FrameIdx + 1;
-        } else {
-          // Inject key press.
-          bool IsModifier;
-          do {
-            IsModifier = false;
-            size_t Rem = strlen(InjectKeyStringPtr);
-            for (int i = 0; i < sizeof(KeyInfo) / sizeof(KeyInfo[0]); i++) {
-              size_t KeyLen = strlen(KeyInfo[i].C64Key);
-              if (!strncmp(InjectKeyStringPtr, KeyInfo[i].C64Key,
-                           std::min<size_t>(Rem, KeyLen))) {
-                uint64_t mask = 1ULL
-                                << (KeyInfo[i].PAIdx * 8 + KeyInfo[i].PBIdx);
-                dut->i_keyboard_mask |= mask;
-                InjectKeyStringPtr += KeyLen;
-                KeyWaitFrameIdx = FrameIdx + 1;
-                if (!strcmp("<LSHIFT>", KeyInfo[i].C64Key) ||
-                    !strcmp("<RSHIFT>", KeyInfo[i].C64Key))
-                  IsModifier = true;
-                break;
-              }
-            }
-          } while (IsModifier);
-        }
-      }
+static void report_stats(Machine &M, bool Final) {
+  Stats->setCounter(StatIds.Cycles, M.Cycle);
+  Stats->setCounter(StatIds.Frames, M.FrameIdx + 1);
+  Stats->setSimSeconds(M.Cycle / ModelClockHz);
+  Stats->setBucket(StatIds.Draw, DrawTicks, DrawCalls);
+  Stats->report(stderr);
+  if (Final && options.stats_json) {
+    FILE *fp = fopen(options.stats_json, "w");
+    if (!fp) {
+      fprintf(stderr, "Unable to open '%s' for writing\n", options.stats_json);
+      return;
+    }
+    Stats->reportJSON(fp);
+    fclose(fp);
+  }
+}
 
-      if (options.save_frame_from <= FrameIdx &&
-          FrameIdx <= options.save_frame_to) {
-        char buf[128];
-        snprintf(buf, sizeof(buf), "%s_%03d.png", options.save_frame_prefix,
-                 FrameIdx);
-        gdk_pixbuf_save(FramePixBuf, buf, "png", NULL, NULL);
-      }
+static void finish_and_exit(Machine &M, int Status = 0) {
+  if (M.Audio)
+    M.Audio->close();
+  delete FrameWriter;
+  VideoOut.close();
+  delete ShmOut;
+  delete Monitor;
+  if (M.trace)
+    M.trace->close();
+  if (M.Recorder)
+    M.dumpRecorder();
+  if (M.InputRec)
+    M.InputRec->close();
+  if (HashLog)
+    HashLog->close();
+
+  if (Stats)
+    report_stats(M, true);
+  if (Pacer)
+    Pacer->report(stderr);
+  if (M.Profile) {
+    if (ProfileFrames)
+      fclose(ProfileFrames);
+    FILE *fp = strcmp(options.profile_file, "-")
+                   ? fopen(options.profile_file, "w")
+                   : stderr;
+    if (fp) {
+      // The listing is disassembled from RAM with both ROMs banked in.
+      Vmyc64_top_myc64_top *Top = M.top();
+      std::vector<uint8_t> Mem(M.mainRAM(), M.mainRAM() + 0x10000);
+      memcpy(&Mem[0xa000], Top->u_rom_basic->u_sprom->mem, 0x2000);
+      memcpy(&Mem[0xe000], Top->u_rom_kernal->u_sprom->mem, 0x2000);
+      M.Profile->report(fp, options.profile_top, Mem.data());
+      if (fp != stderr)
+        fclose(fp);
+    } else {
+      fprintf(stderr, "Unable to open '%s' for writing\n",
+              options.profile_file);
+    }
+  }
 
-      if (FrameIdx >= options.exit_after_frame) {
-        saveWAV(SIDSamples);
-        exit(0);
-      }
+  double Seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - SimStartTime)
+                       .count();
+  fprintf(stderr,
+          "Simulated %d frames (%" PRIu64
+          " cycles) in %.2f s: %.1f frames/s, %.3f MHz\n",
+          M.FrameIdx + 1, M.Cycle, Seconds, (M.FrameIdx + 1) / Seconds,
+          M.Cycle / Seconds / 1e6);
+  exit(Status);
+}
+
+// Exit status of the main machine, set when frame_output() ends the run.
+static int ExitStatus = 0;
+
+// The output that the command line asked for, done whenever the main
+// machine completes a frame. Returns false once the run is over, the caller
+// then stops simulating and leaves finish_and_exit() to the main thread.
+static bool frame_output(Machine &M) {
+  uint64_t T0 = Stats ? PerfStats::now() : 0;
+
+  if (options.save_frame_from <= M.FrameIdx &&
+      M.FrameIdx <= options.save_frame_to &&
+      (M.FrameIdx - options.save_frame_from) % options.save_frame_every == 0) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s_%03d.png", options.save_frame_prefix,
+             M.FrameIdx);
+    FrameWriter->write(M.rgbFrame(), buf);
+  }
+
+  if (VideoOut.isOpen()) {
+    if (VideoOut.indexed())
+      VideoOut.write(M.Raster.frame());
+    else
+      VideoOut.write(M.rgbFrame());
+  }
+
+  if (M.Profile)
+    M.Profile->frame(M.FrameIdx, ProfileFrames);
+
+  if (ShmOut) {
+    ShmOut->publish(M.Raster.frame(), M.FrameIdx, M.dut->i_keyboard_mask);
+    uint64_t Mask = ShmOut->viewerMask();
+    if (Mask != ShmViewerMask && !M.InputReplay) {
+      // Only the keys that the viewer changed.
+      M.dut->i_keyboard_mask =
+          (M.dut->i_keyboard_mask & ~(Mask ^ ShmViewerMask)) |
+          (Mask & (Mask ^ ShmViewerMask));
+      ShmViewerMask = Mask;
+    }
+  }
+
+  if (HashLog) {
+    Vmyc64_top_myc64_top *Top = M.top();
+    FrameHash &H = *M.Hashes;
+    H.m_Hash[FrameHash::RAM] =
+        xxh64(Top->u_ram_main->u_spram->mem,
+              sizeof(Top->u_ram_main->u_spram->mem));
+    H.m_Hash[FrameHash::ColorRAM] =
+        xxh64(Top->u_ram_color->u_spram->mem,
+              sizeof(Top->u_ram_color->u_spram->mem));
+    H.m_Hash[FrameHash::Video] =
+        xxh64(M.Raster.frame().data(), M.Raster.frame().size());
+    if (!HashLog->frame(M.FrameIdx, H)) {
+      ExitStatus = 1;
+      return false;
+    }
+    H.resetAudio();
+  }
+
+  if (M.FrameIdx == options.save_state_frame &&
+      !saveState(M, options.save_state_file)) {
+    ExitStatus = 1;
+    return false;
+  }
+
+  if (Rewind) {
+    std::vector<uint8_t> State;
+    {
+      MemorySave os(State);
+      writeState(M, os);
+    }
+    Rewind->push(M.FrameIdx, State);
+  }
+
+  if (M.trace)
+    M.trace->flush();
+
+  if (FlightRecorderDumpRequested && M.Recorder) {
+    FlightRecorderDumpRequested = 0;
+    M.dumpRecorder();
+  }
+
+  if (Stats) {
+    Stats->charge(StatIds.Output, PerfStats::now() - T0);
+    if (options.stats_every && (M.FrameIdx + 1) % options.stats_every == 0)
+      report_stats(M, false);
+  }
+
+  return M.FrameIdx < options.exit_after_frame;
+}
+
+// Simulate one frame of the main machine.
+static bool simulate_frame(Machine &M) {
+  return M.simulateFrame() && frame_output(M);
+}
+
+// Memory of a debug monitor space, nullptr if there is no such space.
+static uint8_t *monitor_space(Machine &M, unsigned Space, size_t &Size) {
+  Vmyc64_top_myc64_top *Top = M.top();
+  switch (Space) {
+  case DebugMonitor::RAM:
+    Size = sizeof(Top->u_ram_main->u_spram->mem);
+    return Top->u_ram_main->u_spram->mem;
+  case DebugMonitor::ColorRAM:
+    Size = sizeof(Top->u_ram_color->u_spram->mem);
+    return Top->u_ram_color->u_spram->mem;
+  case DebugMonitor::BasicROM:
+    Size = sizeof(Top->u_rom_basic->u_sprom->mem);
+    return Top->u_rom_basic->u_sprom->mem;
+  case DebugMonitor::KernalROM:
+    Size = sizeof(Top->u_rom_kernal->u_sprom->mem);
+    return Top->u_rom_kernal->u_sprom->mem;
+  case DebugMonitor::CharROM:
+    Size = sizeof(Top->u_rom_char->u_sprom->mem);
+    return Top->u_rom_char->u_sprom->mem;
+  }
+  return nullptr;
+}
 
-      if (trace)
-        trace->flush();
+static void monitor_regs(Machine &M, std::vector<uint8_t> &Out) {
+  Vmyc64_top_myc64_top *Top = M.top();
+  Vmyc64_top_cpu *CPU = Top->u_cpu->u_cpu;
+  DebugMonitor::put16(Out, CPU->PC);
+  // The register file is indexed as in cpu.v, SEL_A, SEL_S, SEL_X, SEL_Y.
+  DebugMonitor::put8(Out, CPU->AXYS[0]);
+  DebugMonitor::put8(Out, CPU->AXYS[2]);
+  DebugMonitor::put8(Out, CPU->AXYS[3]);
+  DebugMonitor::put8(Out, CPU->AXYS[1]);
+  DebugMonitor::put8(Out, CPU->N << 7 | CPU->V << 6 | 0x30 | CPU->D << 3 |
+                              CPU->I << 2 | CPU->Z << 1 | CPU->C);
+  DebugMonitor::put8(Out, CPU->state);
+  DebugMonitor::put16(Out, Top->cpu_addr);
+  DebugMonitor::put8(Out, Top->cpu_di);
+  DebugMonitor::put8(Out, Top->cpu_do);
+  DebugMonitor::put8(Out,
+                     Top->cpu_we | Top->vic_ba << 1 | Top->cia1_irq << 2);
+  DebugMonitor::put64(Out, M.Cycle);
+  DebugMonitor::put32(Out, M.FrameIdx);
+  DebugMonitor::put64(Out, M.dut->i_keyboard_mask);
+}
+
+// Run at most N cycles, or until the CPU fetches an opcode at PC if PC is not
+// -1. Frames completed on the way get their usual output, Over is set if one
+// of them ends the run.
+static bool monitor_run(Machine &M, uint32_t N, int PC, bool &Over) {
+  for (uint32_t i = 0; i < N && !M.finished(); i++) {
+    if (M.step() && !frame_output(M)) {
+      Over = true;
+      return false;
+    }
+    if (PC >= 0 && M.cpuCycle() && M.opcodeAddr() == PC)
+      return true;
+  }
+  return PC < 0;
+}
+
+// Returns false if the request ran the machine to the end of the run, the
+// reply has been sent by then.
+static bool monitor_request(Machine &M, const DebugMonitor::Request &R) {
+  std::vector<uint8_t> Out;
+  DebugMonitor::Status S = DebugMonitor::OK;
+  bool Over = false;
+  switch (R.m_Cmd) {
+  case DebugMonitor::Peek:
+  case DebugMonitor::Poke: {
+    size_t Size = 0;
+    uint8_t *Mem = R.has(3) ? monitor_space(M, R.u8(0), Size) : nullptr;
+    size_t Addr = Mem ? R.u16(1) : 0;
+    size_t N = R.m_Cmd == DebugMonitor::Peek ? (R.has(5) ? R.u16(3) : 0)
+                                             : R.m_Args.size() - 3;
+    if (!Mem || (R.m_Cmd == DebugMonitor::Peek && !R.has(5)) ||
+        Addr + N > Size) {
+      S = DebugMonitor::BadArgs;
+    } else if (R.m_Cmd == DebugMonitor::Peek) {
+      Out.assign(Mem + Addr, Mem + Addr + N);
+    } else {
+      // Color RAM is only four bits wide.
+      uint8_t Mask = R.u8(0) == DebugMonitor::ColorRAM ? 0x0f : 0xff;
+      for (size_t i = 0; i < N; i++)
+        Mem[Addr + i] = R.u8(3 + i) & Mask;
+    }
+    break;
+  }
+  case DebugMonitor::Regs:
+    monitor_regs(M, Out);
+    break;
+  case DebugMonitor::Stop:
+    MonitorStopped = true;
+    monitor_regs(M, Out);
+    break;
+  case DebugMonitor::Cont:
+    MonitorStopped = false;
+    break;
+  case DebugMonitor::Step:
+    if (!R.has(4)) {
+      S = DebugMonitor::BadArgs;
+      break;
+    }
+    monitor_run(M, R.u32(0), -1, Over);
+    monitor_regs(M, Out);
+    break;
+  case DebugMonitor::RunToPC:
+    if (!R.has(6)) {
+      S = DebugMonitor::BadArgs;
+      break;
+    }
+    if (!monitor_run(M, R.u32(2), R.u16(0), Over))
+      S = DebugMonitor::NotReached;
+    monitor_regs(M, Out);
+    break;
+  case DebugMonitor::Frame: {
+    const IndexedFrame &F = M.Raster.frame();
+    DebugMonitor::put16(Out, F.width());
+    DebugMonitor::put16(Out, F.height());
+    Out.insert(Out.end(), F.data(), F.data() + F.size());
+    break;
+  }
+  default:
+    S = DebugMonitor::BadCmd;
+    break;
+  }
+  // The client hears of the end of the run before main() exits.
+  if (Over)
+    S = DebugMonitor::Finished;
+  Monitor->reply(S, Out);
+  return !Over;
+}
+
+// Serve the debug monitor between frames. While stopped this only returns
+// once a Cont request arrives, the client goes away or the window closes.
+// Returns false if a request ran the machine to the end of the run.
+static bool service_monitor(Machine &M) {
+  for (;;) {
+    DebugMonitor::Request R;
+    bool Got = Monitor->next(R, MonitorStopped ? 100 : 0);
+    if (Got && !monitor_request(M, R))
+      return false;
+    if (!Monitor->connected())
+      MonitorStopped = false;
+    if (!Got && (!MonitorStopped || SimQuit))
+      return true;
+  }
+}
+
+static gboolean queue_draw(gpointer) {
+  DrawPending = false;
+  gtk_widget_queue_draw(MainWindow);
+  return FALSE;
+}
+
+static gboolean quit_main_loop(gpointer) {
+  gtk_main_quit();
+  return FALSE;
+}
 
-      return TRUE;
+// Apply the key presses and rewind requests that the UI has queued up.
+static void handle_ui_events(Machine &M) {
+  UIEvent E;
+  while (UIEvents.pop(E)) {
+    if (E.Kind == UIEvent::Rewind) {
+      rewind(M, E.Frames);
+      if (Pacer)
+        Pacer->resync(M.Cycle);
+    } else if (!M.InputReplay) {
+      if (E.Kind == UIEvent::KeyDown)
+        M.dut->i_keyboard_mask |= E.Mask;
+      else
+        M.dut->i_keyboard_mask &= ~E.Mask;
     }
   }
+}
+
+static void sim_thread(Machine *M) {
+  auto Next = std::chrono::steady_clock::now();
+  if (Pacer)
+    Pacer->start(M->Cycle);
+  while (!SimQuit) {
+    if (Monitor && !service_monitor(*M))
+      break;
+    handle_ui_events(*M);
+    if (!simulate_frame(*M))
+      break;
 
-  return TRUE;
+    if (Pacer) {
+      if (!Pacer->frame(M->Cycle))
+        continue;
+    } else if (options.frame_rate) {
+      Next += std::chrono::milliseconds(options.frame_rate);
+      std::this_thread::sleep_until(Next);
+    }
+
+    DisplayFrame &F = Display.back();
+    M->Colors.expand(M->Raster.frame(), F.RGB);
+    F.FrameIdx = M->FrameIdx;
+    F.KeyboardMask = M->dut->i_keyboard_mask;
+    Display.publish();
+    if (!DrawPending.exchange(true))
+      g_idle_add(queue_draw, nullptr);
+  }
+  // The run is over, let main() wrap up once the main loop has returned. All
+  // exiting is left to main() as the UI may still be drawing until then.
+  if (!SimQuit)
+    g_idle_add(quit_main_loop, nullptr);
 }
 
 static void print_usage(const char *prog) {
@@ -382,18 +1410,137 @@ static void print_usage(const char *prog) {
   fprintf(stderr, "Usage: %s [OPTIONS]\n\n", prog);
   fprintf(stderr, "  --scale=N             -- set pixel scaling\n");
   fprintf(stderr, "  --frame-rate=N        -- try to produce a new frame every N ms\n");
+  fprintf(stderr, "  --realtime            -- run at the speed of the real machine, overrides --frame-rate\n");
   fprintf(stderr, "  --save-frame-from=N   -- dump frames to .png starting from frame #N\n");
   fprintf(stderr, "  --save-frame-to=N=N   -- dump frames to .png ending with frame #N\n");
+  fprintf(stderr, "  --save-frame-every=N  -- only dump every Nth frame\n");
   fprintf(stderr, "  --save-frame-prefix=S -- prefix dump frame files with S\n");
+  fprintf(stderr, "  --png-threads=N       -- number of threads compressing dumped frames\n");
+  fprintf(stderr, "  --video-out=<FILE>    -- stream all frames to <FILE> (- for stdout)\n");
+  fprintf(stderr, "  --video-format=S      -- format of --video-out, y4m (default), rgb or idx4 (packed 4-bit color indices)\n");
+  fprintf(stderr, "  --shm-frame=<NAME>    -- publish frames in shared memory <NAME> (e.g. /myc64) for myc64-viewer\n");
+  fprintf(stderr, "  --monitor=<PATH>      -- serve the debug monitor on Unix socket <PATH>, see debug-monitor.h\n");
+  fprintf(stderr, "  --rom-kernal=<FILE>   -- raw 8 KiB KERNAL image (default <myc64-sim dir>/../roms/kernal.901227-03.bin)\n");
+  fprintf(stderr, "  --rom-basic=<FILE>    -- raw 8 KiB BASIC image (default <myc64-sim dir>/../roms/basic.901226-01.bin)\n");
+  fprintf(stderr, "  --rom-char=<FILE>     -- raw 4 KiB character image (default <myc64-sim dir>/../roms/characters.901225-01.bin)\n");
+  fprintf(stderr, "  --palette=S           -- myc64 (default), pepto, colodore or a file with 16 RRGGBB values\n");
+  fprintf(stderr, "  --wav-out=<FILE>      -- write SID output to <FILE> (default out.wav, empty for none)\n");
+  fprintf(stderr, "  --audio-rate=N        -- sample rate of --wav-out (default 48000)\n");
+  fprintf(stderr, "  --bench-audio         -- compare cost of audio filter with model evaluation\n");
+  fprintf(stderr, "  --stats               -- report where host time is spent on exit\n");
+  fprintf(stderr, "  --stats-every=N       -- also report every N frames (implies --stats)\n");
+  fprintf(stderr, "  --stats-json=<FILE>   -- also write final report as JSON (implies --stats)\n");
+  fprintf(stderr, "  --profile=<FILE>      -- profile the 6502 program, report to <FILE> (- for stderr) on exit\n");
+  fprintf(stderr, "  --profile-frames=<FILE> -- also write a line per frame to <FILE>\n");
+  fprintf(stderr, "  --profile-labels=<FILE> -- ld65 label (-Ln) or map (-m) file to name profiled addresses and list hot labels\n");
+  fprintf(stderr, "  --profile-top=N       -- number of hottest addresses/labels to report (default 20)\n");
   fprintf(stderr, "  --exit-after-frame=N  -- exit after frame #N\n");
-  fprintf(stderr, "  --trace               -- create dump.vcd\n");
-  fprintf(stderr, "  --cmd-load-prg=<FRAME>:<PRG>           -- wait until <FRAME> then load <PRG>\n");
-  fprintf(stderr, "  --cmd-inject-keys=<FRAME>:<KEYS>       -- wait until <FRAME> then inject <KEYS>\n");
-  fprintf(stderr, "  --cmd-dump-ram=<FRAME>:<ADDR>:<LENGTH> -- wait until <FRAME> then dump <LENGTH> bytes of RAM starting at <ADDR>\n");
+  fprintf(stderr, "  --trace               -- trace the whole run to " TRACE_FILE_DEFAULT "\n");
+  fprintf(stderr, "  --trace-frames=A:B    -- only trace frames #A to #B (either may be omitted)\n");
+  fprintf(stderr, "  --trace-cycles=A:B    -- only trace cycles #A to #B (either may be omitted)\n");
+  fprintf(stderr, "  --trace-trigger=T     -- start tracing on CPU bus access, addr:<ADDR> or write:<ADDR>[=<DATA>]\n");
+  fprintf(stderr, "  --trace-length=N      -- cycles to trace after --trace-trigger (default 100000)\n");
+  fprintf(stderr, "  --trace-file=<FILE>   -- trace to <FILE> instead of " TRACE_FILE_DEFAULT "\n");
+  fprintf(stderr, "  --rewind=<SECONDS>    -- keep the last <SECONDS> in memory, F9/F10 in the window go back a second/frame\n");
+  fprintf(stderr, "  --rewind-mb=<MB>      -- memory budget for --rewind (default 256)\n");
+  fprintf(stderr, "  --hash-log=<FILE>     -- write hashes of RAM, color RAM, frame and audio for each frame to <FILE>\n");
+  fprintf(stderr, "  --hash-golden=<FILE>  -- compare each frame against a --hash-log from an earlier run, stop at the first difference\n");
+  fprintf(stderr, "  --record-input=<FILE> -- log every keyboard change with its cycle to <FILE>\n");
+  fprintf(stderr, "  --replay-input=<FILE> -- play back keyboard changes from <FILE>, keys from the window are ignored\n");
+  fprintf(stderr, "  --drive8=<DIR>        -- serve KERNAL LOAD/SAVE on device 8 from <DIR>\n");
+  fprintf(stderr, "  --flight-recorder=N   -- keep the last N CPU bus cycles, written on exit and SIGUSR1\n");
+  fprintf(stderr, "  --flight-recorder-format=S  -- vcd (default) or bin\n");
+  fprintf(stderr, "  --flight-recorder-prefix=S  -- write to S-<CYCLE>.vcd (default flight)\n");
+  fprintf(stderr, "  --flight-recorder-trigger=T -- also write on CPU bus access, addr:<ADDR> or write:<ADDR>[=<DATA>]\n");
+  fprintf(stderr, "  --headless            -- run without GTK window as fast as possible\n");
+  fprintf(stderr, "  --cmd-load-prg=<WHEN>:<PRG>            -- wait until <WHEN> then load <PRG>\n");
+  fprintf(stderr, "  --cmd-inject-keys=<WHEN>:<KEYS>        -- wait until <WHEN> then inject <KEYS>\n");
+  fprintf(stderr, "  --cmd-type-keys=<WHEN>:<KEYS>          -- wait until <WHEN> then type <KEYS> through the KERNAL keyboard buffer\n");
+  fprintf(stderr, "  --cmd-dump-ram=<WHEN>:<ADDR>:<LENGTH>  -- wait until <WHEN> then dump <LENGTH> bytes of RAM starting at <ADDR>\n");
+  fprintf(stderr, "      <WHEN> is one of <FRAME>, cycle=<CYCLE>, pc=<ADDR>[+<FRAMES>] or mem=<ADDR>=<VALUE>[+<FRAMES>]\n");
+  fprintf(stderr, "  --save-state=<FRAME>:<FILE>            -- save machine state to <FILE> at <FRAME>\n");
+  fprintf(stderr, "  --load-state=<FILE>                    -- resume from machine state in <FILE>\n");
+  fprintf(stderr, "  --run-jobs=<FILE>     -- run all jobs in manifest <FILE> (one per line: NAME ARGS...)\n");
+  fprintf(stderr, "  --fork-server=<FRAME> -- simulate to <FRAME> once, then fork a child per job line read from stdin\n");
+  fprintf(stderr, "  --threads=N           -- number of worker threads for --run-jobs (children for --fork-server)\n");
+  fprintf(stderr, "  --report=<FILE>       -- write --run-jobs JSON report to <FILE> instead of stdout\n");
   fprintf(stderr, "\n");
   // clang-format on
 }
 
+static void bad_arg() {
+  print_usage(ProgName);
+  exit(1);
+}
+
+// Parse the <WHEN> part of a --cmd-* option, see CommandWhen. Returns a
+// pointer past the ':' that ends it.
+static const char *parse_when(const char *Str, CommandWhen &W) {
+  char *EndPtr;
+  if (!strncmp(Str, "cycle=", 6)) {
+    W.m_Kind = CommandWhen::Cycle;
+    W.m_Value = strtoull(Str + 6, &EndPtr, 0);
+  } else if (!strncmp(Str, "pc=", 3)) {
+    W.m_Kind = CommandWhen::PC;
+    W.m_Value = strtoul(Str + 3, &EndPtr, 0) & 0xffff;
+  } else if (!strncmp(Str, "mem=", 4)) {
+    W.m_Kind = CommandWhen::Mem;
+    W.m_Value = strtoul(Str + 4, &EndPtr, 0) & 0xffff;
+    if (*EndPtr != '=')
+      bad_arg();
+    W.m_Data = strtoul(EndPtr + 1, &EndPtr, 0);
+  } else {
+    W.m_Kind = CommandWhen::Frame;
+    W.m_Value = strtol(Str, &EndPtr, 0);
+  }
+  if (*EndPtr == '+' && (W.m_Kind == CommandWhen::PC ||
+                         W.m_Kind == CommandWhen::Mem))
+    W.m_Delay = strtol(EndPtr + 1, &EndPtr, 0);
+  if (*EndPtr != ':')
+    bad_arg();
+  return EndPtr + 1;
+}
+
+// Create the command described by a --cmd-* argument. Returns nullptr if Arg
+// is not a command.
+static Command *parse_command(const char *Arg) {
+  int off;
+  CommandWhen When;
+  Command *Cmd = nullptr;
+#define MATCH(x) (!strncmp(Arg, x, strlen(x)) && (off = strlen(x)))
+  if (MATCH("--cmd-inject-keys=")) {
+    const char *Keys = parse_when(&Arg[off], When);
+    Cmd = new CommandInjectKeys(Keys);
+  } else if (MATCH("--cmd-type-keys=")) {
+    std::string PETSCII;
+    if (!keys_to_petscii(parse_when(&Arg[off], When), PETSCII))
+      bad_arg();
+    Cmd = new CommandTypeKeys(PETSCII);
+  } else if (MATCH("--cmd-dump-ram=")) {
+    char *EndPtr;
+    const char *Str = parse_when(&Arg[off], When);
+    uint16_t Address = strtol(Str, &EndPtr, 0);
+    if (*EndPtr != ':')
+      bad_arg();
+    EndPtr++;
+    uint16_t Size = strtol(EndPtr, &EndPtr, 0);
+    if (*EndPtr != '\0')
+      bad_arg();
+    Cmd = new CommandDumpRAM(Address, Size);
+  } else if (MATCH("--cmd-load-prg=")) {
+    const char *Path = parse_when(&Arg[off], When);
+    Cmd = new CommandLoadPRG(Path);
+  }
+#undef MATCH
+  if (Cmd) {
+    Cmd->m_When = When;
+    Cmd->m_Arg = Arg;
+  }
+  return Cmd;
+}
+
+static std::vector<Command *> CmdLineCommands;
+
 static void parse_cmd_args(int argc, char *argv[]) {
   int off;
 #define MATCH(x) (!strncmp(argv[i], x, strlen(x)) && (off = strlen(x)))
@@ -402,135 +1549,897 @@ static void parse_cmd_args(int argc, char *argv[]) {
       options.scale = strtol(&argv[i][off], NULL, 0);
     } else if (MATCH("--frame-rate=")) {
       options.frame_rate = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--realtime")) {
+      options.realtime = true;
     } else if (MATCH("--save-frame-from=")) {
       options.save_frame_from = strtol(&argv[i][off], NULL, 0);
     } else if (MATCH("--save-frame-to=")) {
       options.save_frame_to = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--save-frame-every=")) {
+      options.save_frame_every = strtol(&argv[i][off], NULL, 0);
+      if (options.save_frame_every < 1)
+        bad_arg();
     } else if (MATCH("--save-frame-prefix=")) {
       options.save_frame_prefix = &argv[i][off];
+    } else if (MATCH("--png-threads=")) {
+      options.png_threads = strtol(&argv[i][off], NULL, 0);
+      if (options.png_threads < 1)
+        bad_arg();
+    } else if (MATCH("--video-out=")) {
+      options.video_out = &argv[i][off];
+    } else if (MATCH("--monitor=")) {
+      options.monitor_socket = &argv[i][off];
+    } else if (MATCH("--shm-frame=")) {
+      options.shm_frame = &argv[i][off];
+    } else if (MATCH("--video-format=")) {
+      if (!VideoWriter::parseFormat(&argv[i][off], options.video_format))
+        bad_arg();
+    } else if (MATCH("--rom-kernal=")) {
+      options.rom_kernal = &argv[i][off];
+    } else if (MATCH("--rom-basic=")) {
+      options.rom_basic = &argv[i][off];
+    } else if (MATCH("--rom-char=")) {
+      options.rom_char = &argv[i][off];
+    } else if (MATCH("--palette=")) {
+      options.palette = &argv[i][off];
+    } else if (MATCH("--wav-out=")) {
+      options.wav_out = &argv[i][off];
+    } else if (MATCH("--audio-rate=")) {
+      options.audio_rate = strtol(&argv[i][off], NULL, 0);
+      if (options.audio_rate < 8000 || options.audio_rate > 192000)
+        bad_arg();
+    } else if (MATCH("--bench-audio")) {
+      options.bench_audio = true;
+    } else if (MATCH("--stats-every=")) {
+      options.stats = true;
+      options.stats_every = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--stats-json=")) {
+      options.stats = true;
+      options.stats_json = &argv[i][off];
+    } else if (MATCH("--stats")) {
+      options.stats = true;
+    } else if (MATCH("--profile=")) {
+      options.profile_file = &argv[i][off];
+    } else if (MATCH("--profile-frames=")) {
+      options.profile_frames_file = &argv[i][off];
+    } else if (MATCH("--profile-labels=")) {
+      options.profile_labels = &argv[i][off];
+    } else if (MATCH("--profile-top=")) {
+      options.profile_top = strtoul(&argv[i][off], NULL, 0);
     } else if (MATCH("--exit-after-frame=")) {
       options.exit_after_frame = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--trace-frames=")) {
+      options.trace = true;
+      if (!options.trace_ctl.setFrames(&argv[i][off]))
+        bad_arg();
+    } else if (MATCH("--trace-cycles=")) {
+      options.trace = true;
+      if (!options.trace_ctl.setCycles(&argv[i][off]))
+        bad_arg();
+    } else if (MATCH("--trace-trigger=")) {
+      options.trace = true;
+      if (!options.trace_ctl.setTrigger(&argv[i][off]))
+        bad_arg();
+    } else if (MATCH("--trace-length=")) {
+      options.trace_ctl.setLength(strtoull(&argv[i][off], NULL, 0));
+    } else if (MATCH("--trace-file=")) {
+      options.trace = true;
+      options.trace_file = &argv[i][off];
     } else if (MATCH("--trace")) {
       options.trace = true;
-    } else if (MATCH("--cmd-inject-keys=")) {
-      char *EndPtr;
-      int CmdFrameIdx = strtol(&argv[i][off], &EndPtr, 0);
-      if (*EndPtr != ':') {
-        print_usage(argv[0]);
-        exit(1);
-      }
-      EndPtr++;
-      Commands.push_back(new CommandInjectKeys(CmdFrameIdx, EndPtr));
-    } else if (MATCH("--cmd-dump-ram=")) {
+    } else if (MATCH("--rewind=")) {
+      options.rewind_seconds = strtoul(&argv[i][off], NULL, 0);
+    } else if (MATCH("--rewind-mb=")) {
+      options.rewind_mb = strtoul(&argv[i][off], NULL, 0);
+    } else if (MATCH("--hash-log=")) {
+      options.hash_log = &argv[i][off];
+    } else if (MATCH("--hash-golden=")) {
+      options.hash_golden = &argv[i][off];
+    } else if (MATCH("--record-input=")) {
+      options.record_input = &argv[i][off];
+    } else if (MATCH("--replay-input=")) {
+      options.replay_input = &argv[i][off];
+    } else if (MATCH("--drive8=")) {
+      options.drive8_dir = &argv[i][off];
+    } else if (MATCH("--flight-recorder=")) {
+      options.flight_recorder = strtoul(&argv[i][off], NULL, 0);
+    } else if (MATCH("--flight-recorder-format=")) {
+      options.flight_recorder_binary = !strcmp(&argv[i][off], "bin");
+      if (!options.flight_recorder_binary && strcmp(&argv[i][off], "vcd"))
+        bad_arg();
+    } else if (MATCH("--flight-recorder-prefix=")) {
+      options.flight_recorder_prefix = &argv[i][off];
+    } else if (MATCH("--flight-recorder-trigger=")) {
+      if (!options.flight_recorder_trigger.parse(&argv[i][off]))
+        bad_arg();
+    } else if (MATCH("--headless")) {
+      options.headless = true;
+    } else if (MATCH("--save-state=")) {
       char *EndPtr;
-      int CmdFrameIdx = strtol(&argv[i][off], &EndPtr, 0);
-      if (*EndPtr != ':') {
-        print_usage(argv[0]);
-        exit(1);
-      }
-      EndPtr++;
-      uint16_t Address = strtol(EndPtr, &EndPtr, 0);
-      if (*EndPtr != ':') {
-        print_usage(argv[0]);
-        exit(1);
+      options.save_state_frame = strtol(&argv[i][off], &EndPtr, 0);
+      if (*EndPtr != ':')
+        bad_arg();
+      options.save_state_file = EndPtr + 1;
+    } else if (MATCH("--load-state=")) {
+      options.load_state_file = &argv[i][off];
+    } else if (MATCH("--run-jobs=")) {
+      options.run_jobs_file = &argv[i][off];
+    } else if (MATCH("--fork-server=")) {
+      options.fork_frame = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--threads=")) {
+      options.num_threads = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--report=")) {
+      options.report_file = &argv[i][off];
+    } else if (Command *Cmd = parse_command(argv[i])) {
+      CmdLineCommands.push_back(Cmd);
+    } else {
+      bad_arg();
+    }
+  }
+#undef MATCH
+
+  // Frames streamed to stdout cannot share it with text output.
+  if (options.video_out && !strcmp(options.video_out, "-")) {
+    const char *Other = nullptr;
+    for (Command *Cmd : CmdLineCommands)
+      if (dynamic_cast<CommandDumpRAM *>(Cmd))
+        Other = "--cmd-dump-ram";
+    if (options.run_jobs_file && !options.report_file)
+      Other = "--run-jobs without --report";
+    if (options.fork_frame >= 0)
+      Other = "--fork-server";
+    if (options.bench_audio)
+      Other = "--bench-audio";
+    if (Other) {
+      fprintf(stderr, "--video-out=- writes to stdout, as does %s\n", Other);
+      exit(1);
+    }
+  }
+}
+
+//
+// Regression runner (--run-jobs).
+//
+// Each line of the manifest describes one job as a name followed by the same
+// --cmd-*, --load-state and --exit-after-frame arguments that a single run
+// takes. Jobs are handed out to a pool of worker threads, each job simulating
+// on its own Machine, and the outcome of all jobs is written as one JSON
+// report.
+//
+
+struct Job {
+  std::string m_Name;
+  std::vector<Command *> m_Commands;
+  std::string m_LoadState;
+  int m_ExitAfterFrame = -1;
+  // Results.
+  bool m_Finished = false;
+  int m_Frames = 0;
+  uint64_t m_Cycles = 0;
+  double m_Seconds = 0;
+  uint64_t m_RAMHash = 0;
+  std::vector<RAMDump> m_RAMDumps;
+};
+
+// Parse one manifest line into J. Blank lines and comments leave J without a
+// name.
+static bool parse_job(const std::string &Line, Job &J, std::string &Error) {
+  std::vector<char> Str(Line.begin(), Line.end());
+  Str.push_back('\0');
+  char *SavePtr;
+  char *Tok = strtok_r(Str.data(), " \t\r\n", &SavePtr);
+  if (!Tok || Tok[0] == '#')
+    return true;
+  J.m_Name = Tok;
+  while ((Tok = strtok_r(nullptr, " \t\r\n", &SavePtr))) {
+    int off;
+#define MATCH(x) (!strncmp(Tok, x, strlen(x)) && (off = strlen(x)))
+    if (MATCH("--exit-after-frame=")) {
+      J.m_ExitAfterFrame = strtol(&Tok[off], NULL, 0);
+    } else if (MATCH("--load-state=")) {
+      J.m_LoadState = &Tok[off];
+    } else if (Command *Cmd = parse_command(Tok)) {
+      J.m_Commands.push_back(Cmd);
+    } else {
+      Error = std::string("unsupported job argument '") + Tok + "'";
+      return false;
+    }
+#undef MATCH
+  }
+  if (J.m_ExitAfterFrame < 0) {
+    Error = "job '" + J.m_Name + "' lacks --exit-after-frame";
+    return false;
+  }
+  return true;
+}
+
+static std::vector<Job> parse_jobs(const char *Path) {
+  std::ifstream In(Path);
+  if (!In) {
+    fprintf(stderr, "Unable to open job manifest '%s'\n", Path);
+    exit(1);
+  }
+  std::vector<Job> Jobs;
+  std::string Line;
+  int LineNo = 0;
+  while (std::getline(In, Line)) {
+    LineNo++;
+    Job J;
+    std::string Error;
+    if (!parse_job(Line, J, Error)) {
+      fprintf(stderr, "%s:%d: %s\n", Path, LineNo, Error.c_str());
+      exit(1);
+    }
+    if (J.m_Name.empty())
+      continue;
+    Jobs.push_back(J);
+  }
+  return Jobs;
+}
+
+// Schedule the commands of J on M, which already is in its starting state,
+// and simulate until the job is done.
+static void simulate_job(Machine &M, Job &J,
+                         std::chrono::steady_clock::time_point Start) {
+  for (Command *Cmd : J.m_Commands)
+    M.Scheduler.add(Cmd);
+  J.m_Commands.clear();
+
+  while (M.FrameIdx < J.m_ExitAfterFrame) {
+    if (!M.simulateFrame()) {
+      J.m_Finished = true;
+      break;
+    }
+  }
+
+  J.m_Frames = M.FrameIdx + 1;
+  J.m_Cycles = M.Cycle;
+  J.m_RAMHash = xxh64(M.mainRAM(), 0x10000);
+  J.m_RAMDumps.swap(M.RAMDumps);
+  J.m_Seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - Start)
+                    .count();
+}
+
+// A machine set up the way the command line asks for, except for commands.
+static void setup_batch_machine(Machine &M, const std::string &Name) {
+  M.CollectRAMDumps = true;
+  // In a regression run only the trigger writes the flight recorder.
+  if (options.flight_recorder) {
+    M.Recorder = new FlightRecorder(options.flight_recorder);
+    M.RecorderTrigger = options.flight_recorder_trigger;
+    M.RecorderPrefix =
+        std::string(options.flight_recorder_prefix) + "-" + Name;
+    M.RecorderBinary = options.flight_recorder_binary;
+  }
+  if (options.drive8_dir)
+    M.Drive8 = new KernalDiskTrap(options.drive8_dir);
+}
+
+static void run_job(Job &J) {
+  auto Start = std::chrono::steady_clock::now();
+
+  Machine M;
+  setup_batch_machine(M, J.m_Name);
+  if (!J.m_LoadState.empty())
+    loadState(M, J.m_LoadState.c_str());
+  else
+    M.reset();
+  simulate_job(M, J, Start);
+}
+
+static void write_json_string(FILE *fp, const std::string &Str) {
+  fputc('"', fp);
+  for (char c : Str) {
+    if (c == '"' || c == '\\')
+      fputc('\\', fp);
+    fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+// The outcome of one job as a JSON object, all on one line if Compact.
+static void write_job(FILE *fp, const Job &J, bool Compact) {
+  const char *Field = Compact ? " " : "\n      ";
+  const char *Dump = Compact ? " " : "\n        ";
+  const char *End = Compact ? " " : "\n    ";
+  fprintf(fp, "{%s\"name\": ", Field);
+  write_json_string(fp, J.m_Name);
+  fprintf(fp, ",%s\"status\": \"%s\",", Field,
+          J.m_Finished ? "finished" : "ok");
+  fprintf(fp, "%s\"frames\": %d,", Field, J.m_Frames);
+  fprintf(fp, "%s\"cycles\": %" PRIu64 ",", Field, J.m_Cycles);
+  fprintf(fp, "%s\"seconds\": %.3f,", Field, J.m_Seconds);
+  fprintf(fp, "%s\"ram_hash\": \"%016" PRIx64 "\",", Field, J.m_RAMHash);
+  fprintf(fp, "%s\"ram_dumps\": [", Field);
+  for (size_t d = 0; d < J.m_RAMDumps.size(); d++) {
+    const RAMDump &D = J.m_RAMDumps[d];
+    fprintf(fp, "%s%s{\"frame\": %d, \"address\": %u, \"data\": \"",
+            d ? "," : "", Dump, D.m_FrameIdx, D.m_Address);
+    for (uint8_t b : D.m_Data)
+      fprintf(fp, "%02x", b);
+    fprintf(fp, "\"}");
+  }
+  fprintf(fp, "%s]%s}", J.m_RAMDumps.empty() ? "" : Field, End);
+}
+
+static void write_report(FILE *fp, const std::vector<Job> &Jobs,
+                         unsigned NumThreads, double Seconds) {
+  uint64_t TotalCycles = 0;
+  for (const Job &J : Jobs)
+    TotalCycles += J.m_Cycles;
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"threads\": %u,\n", NumThreads);
+  fprintf(fp, "  \"seconds\": %.3f,\n", Seconds);
+  fprintf(fp, "  \"mhz\": %.3f,\n", TotalCycles / Seconds / 1e6);
+  fprintf(fp, "  \"jobs\": [\n");
+  for (size_t i = 0; i < Jobs.size(); i++) {
+    fprintf(fp, "    ");
+    write_job(fp, Jobs[i], false);
+    fprintf(fp, "%s\n", i + 1 < Jobs.size() ? "," : "");
+  }
+  fprintf(fp, "  ]\n}\n");
+}
+
+static int run_jobs() {
+  std::vector<Job> Jobs = parse_jobs(options.run_jobs_file);
+
+  unsigned NumThreads = options.num_threads;
+  if (!NumThreads)
+    NumThreads = std::max(1u, std::thread::hardware_concurrency());
+  NumThreads = std::min<unsigned>(NumThreads, std::max<size_t>(1, Jobs.size()));
+
+  auto Start = std::chrono::steady_clock::now();
+
+  std::atomic<size_t> NextJob(0);
+  std::vector<std::thread> Workers;
+  for (unsigned i = 0; i < NumThreads; i++) {
+    Workers.emplace_back([&]() {
+      size_t Idx;
+      while ((Idx = NextJob++) < Jobs.size())
+        run_job(Jobs[Idx]);
+    });
+  }
+  for (std::thread &T : Workers)
+    T.join();
+
+  double Seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - Start)
+                       .count();
+
+  FILE *fp = stdout;
+  if (options.report_file && !(fp = fopen(options.report_file, "w"))) {
+    fprintf(stderr, "Unable to open report file '%s'\n", options.report_file);
+    return 1;
+  }
+  write_report(fp, Jobs, NumThreads, Seconds);
+  if (fp != stdout)
+    fclose(fp);
+
+  return 0;
+}
+
+//
+// Fork server (--fork-server).
+//
+// The command line is simulated once up to the given frame, after which a
+// copy-on-write child of that machine is forked for each variant read from
+// stdin. Variants use the --run-jobs manifest format (except --load-state)
+// and each one is reported on stdout as a single JSON line, in the order the
+// variants were read, as soon as it is done. At most --threads children run
+// at the same time.
+//
+
+struct ForkChild {
+  std::string m_Name;
+  pid_t m_Pid = -1;
+  // Read end of the pipe the child reports on, -1 once m_Output is complete.
+  int m_Fd = -1;
+  std::string m_Output;
+};
+
+static std::string fork_status_line(const std::string &Name,
+                                    const char *Status) {
+  char *Buf;
+  size_t Size;
+  FILE *fp = open_memstream(&Buf, &Size);
+  fprintf(fp, "{ \"name\": ");
+  write_json_string(fp, Name);
+  fprintf(fp, ", \"status\": \"%s\" }\n", Status);
+  fclose(fp);
+  std::string Line(Buf, Size);
+  free(Buf);
+  return Line;
+}
+
+static void fork_variant(Machine &M, const std::string &Line,
+                         std::deque<ForkChild> &Children) {
+  Job J;
+  std::string Error;
+  bool Ok = parse_job(Line, J, Error);
+  if (Ok && J.m_Name.empty())
+    return;
+  if (Ok && !J.m_LoadState.empty()) {
+    Error = "--load-state is not supported by the fork server";
+    Ok = false;
+  }
+
+  ForkChild C;
+  C.m_Name = J.m_Name;
+  if (!Ok) {
+    fprintf(stderr, "Bad variant: %s\n", Error.c_str());
+    C.m_Output = fork_status_line(C.m_Name, "error");
+  } else {
+    int Pipe[2];
+    if (pipe(Pipe)) {
+      perror("pipe");
+      exit(1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    C.m_Pid = fork();
+    if (C.m_Pid == 0) {
+      close(Pipe[0]);
+      simulate_job(M, J, std::chrono::steady_clock::now());
+      FILE *fp = fdopen(Pipe[1], "w");
+      write_job(fp, J, true);
+      fputc('\n', fp);
+      fclose(fp);
+      // Skip exit handlers and buffers inherited from the server.
+      _exit(0);
+    }
+    close(Pipe[1]);
+    if (C.m_Pid < 0) {
+      perror("fork");
+      exit(1);
+    }
+    C.m_Fd = Pipe[0];
+  }
+  for (Command *Cmd : J.m_Commands)
+    delete Cmd;
+  Children.push_back(C);
+}
+
+static int run_fork_server() {
+  Machine M;
+  setup_batch_machine(M, "fork");
+  if (options.load_state_file)
+    loadState(M, options.load_state_file);
+  else
+    M.reset();
+  for (Command *Cmd : CmdLineCommands)
+    M.Scheduler.add(Cmd);
+  CmdLineCommands.clear();
+  while (M.FrameIdx < options.fork_frame) {
+    if (!M.simulateFrame()) {
+      fprintf(stderr, "Simulation finished before frame %d\n",
+              options.fork_frame);
+      return 1;
+    }
+  }
+  M.RAMDumps.clear();
+  fprintf(stderr, "Fork server ready at frame %d\n", M.FrameIdx);
+
+  unsigned MaxChildren = options.num_threads;
+  if (!MaxChildren)
+    MaxChildren = std::max(1u, std::thread::hardware_concurrency());
+
+  std::deque<ForkChild> Children;
+  std::deque<std::string> Variants;
+  std::string Input;
+  bool InputDone = false;
+  while (!InputDone || !Variants.empty() || !Children.empty()) {
+    while (!Variants.empty() && Children.size() < MaxChildren) {
+      fork_variant(M, Variants.front(), Children);
+      Variants.pop_front();
+    }
+    // Results go out in order, so only the oldest child is listened to.
+    while (!Children.empty() && Children.front().m_Fd < 0) {
+      fputs(Children.front().m_Output.c_str(), stdout);
+      fflush(stdout);
+      Children.pop_front();
+    }
+    if (InputDone && Children.empty())
+      continue;
+
+    struct pollfd Fds[2];
+    nfds_t NumFds = 0;
+    if (!InputDone)
+      Fds[NumFds++] = {0, POLLIN, 0};
+    if (!Children.empty())
+      Fds[NumFds++] = {Children.front().m_Fd, POLLIN, 0};
+    if (poll(Fds, NumFds, -1) < 0)
+      continue;
+
+    char Buf[4096];
+    for (nfds_t i = 0; i < NumFds; i++) {
+      if (!Fds[i].revents)
+        continue;
+      ssize_t N = read(Fds[i].fd, Buf, sizeof(Buf));
+      if (Fds[i].fd == 0) {
+        if (N > 0)
+          Input.append(Buf, N);
+        else
+          InputDone = true;
+        size_t Pos;
+        while ((Pos = Input.find('\n')) != std::string::npos) {
+          Variants.push_back(Input.substr(0, Pos));
+          Input.erase(0, Pos + 1);
+        }
+        if (InputDone && !Input.empty())
+          Variants.push_back(Input);
+        continue;
       }
-      EndPtr++;
-      uint16_t Size = strtol(EndPtr, &EndPtr, 0);
-      if (*EndPtr != '\0') {
-        print_usage(argv[0]);
-        exit(1);
+      ForkChild &C = Children.front();
+      if (N > 0) {
+        C.m_Output.append(Buf, N);
+        continue;
       }
-      Commands.push_back(new CommandDumpRAM(CmdFrameIdx, Address, Size));
-    } else if (MATCH("--cmd-load-prg=")) {
-      char *EndPtr;
-      int CmdFrameIdx = strtol(&argv[i][off], &EndPtr, 0);
-      if (*EndPtr != ':') {
-        print_usage(argv[0]);
-        exit(1);
+      close(C.m_Fd);
+      C.m_Fd = -1;
+      int Status;
+      waitpid(C.m_Pid, &Status, 0);
+      if (!WIFEXITED(Status) || WEXITSTATUS(Status) || C.m_Output.empty()) {
+        fprintf(stderr, "Variant '%s' did not finish\n", C.m_Name.c_str());
+        C.m_Output = fork_status_line(C.m_Name, "crashed");
       }
-      EndPtr++;
-      Commands.push_back(new CommandLoadPRG(CmdFrameIdx, EndPtr));
-    } else {
-      print_usage(argv[0]);
-      exit(1);
     }
   }
+  return 0;
+}
+
+// Time model evaluation and the audio filter separately over the same number
+// of cycles, the filter being fed the SID output recorded from the model.
+static int run_audio_benchmark() {
+  const unsigned NumCycles = 8000000;
+  std::vector<int16_t> Wave(NumCycles);
+
+  Machine M;
+  M.reset();
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < NumCycles; i++) {
+    M.tick();
+    Wave[i] = M.dut->o_wave;
+  }
+  double EvalSeconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - Start)
+                           .count();
+
+  AudioDecimator Filter(ModelClockHz, 8, options.audio_rate);
+  unsigned NumOut = 0;
+  Start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < NumCycles; i++) {
+    int16_t Sample;
+    NumOut += Filter.push(Wave[i], Sample);
+  }
+  double FilterSeconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - Start)
+                             .count();
+
+  printf("Audio filter: %u taps, %u Hz, %u output samples\n",
+         Filter.numTaps(), options.audio_rate, NumOut);
+  printf("eval():       %8.2f ns/cycle\n", EvalSeconds / NumCycles * 1e9);
+  printf("Audio filter: %8.2f ns/cycle (%.2f%% of eval)\n",
+         FilterSeconds / NumCycles * 1e9, 100.0 * FilterSeconds / EvalSeconds);
+  return 0;
+}
+
+// The default ROM images are in ../roms as seen from the directory of the
+// executable, whatever the current directory is.
+static std::string default_rom_path(const char *Name) {
+  char Exe[4096];
+  ssize_t Len = readlink("/proc/self/exe", Exe, sizeof(Exe) - 1);
+  if (Len <= 0) {
+    fprintf(stderr, "Unable to locate the executable for the default ROM "
+                    "images, run from sim/ or give --rom-kernal, --rom-basic "
+                    "and --rom-char\n");
+    return std::string("../roms/") + Name;
+  }
+  std::string Dir(Exe, Len);
+  Dir.erase(Dir.find_last_of('/') + 1);
+  return Dir + "../roms/" + Name;
 }
 
 int main(int argc, char *argv[]) {
 
-  GtkWidget *window;
   GtkWidget *darea;
 
-  gtk_init(&argc, &argv);
-
   // Set default options.
   options.scale = 3;
   options.frame_rate = 0;
+  options.realtime = false;
   options.save_frame_from = INT_MAX;
   options.save_frame_to = INT_MAX;
+  options.save_frame_every = 1;
   options.save_frame_prefix = "frame";
+  options.png_threads = 2;
+  options.video_out = nullptr;
+  options.shm_frame = nullptr;
+  options.monitor_socket = nullptr;
+  options.video_format = VideoWriter::Y4M;
+  options.palette = "myc64";
+  options.rom_kernal = nullptr;
+  options.rom_basic = nullptr;
+  options.rom_char = nullptr;
+  options.wav_out = "out.wav";
+  options.audio_rate = 48000;
+  options.bench_audio = false;
+  options.stats = false;
+  options.stats_every = 0;
+  options.stats_json = nullptr;
+  options.profile_file = nullptr;
+  options.profile_frames_file = nullptr;
+  options.profile_labels = nullptr;
+  options.profile_top = 20;
   options.exit_after_frame = INT_MAX;
   options.trace = false;
+  options.trace_file = TRACE_FILE_DEFAULT;
+  options.drive8_dir = nullptr;
+  options.record_input = nullptr;
+  options.hash_log = nullptr;
+  options.rewind_seconds = 0;
+  options.rewind_mb = 256;
+  options.hash_golden = nullptr;
+  options.replay_input = nullptr;
+  options.flight_recorder = 0;
+  options.flight_recorder_binary = false;
+  options.flight_recorder_prefix = "flight";
+  options.headless = false;
+  options.save_state_frame = INT_MAX;
+  options.save_state_file = nullptr;
+  options.load_state_file = nullptr;
+  options.run_jobs_file = nullptr;
+  options.fork_frame = -1;
+  options.report_file = nullptr;
+  options.num_threads = 0;
+
+  ProgName = argv[0];
+
+  // GTK wants to see (and strip) its own options before we parse ours, but
+  // in headless mode there is no display to connect to.
+  for (int i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "--headless") || !strcmp(argv[i], "--bench-audio") ||
+        !strncmp(argv[i], "--run-jobs=", 11) ||
+        !strncmp(argv[i], "--fork-server=", 14))
+      options.headless = true;
+
+  if (!options.headless)
+    gtk_init(&argc, &argv);
 
   parse_cmd_args(argc, argv);
 
-  window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-
-  darea = gtk_drawing_area_new();
-  gtk_container_add(GTK_CONTAINER(window), darea);
-
-  g_signal_connect(G_OBJECT(darea), "draw", G_CALLBACK(on_draw_event), NULL);
-  g_signal_connect(G_OBJECT(window), "key_press_event",
-                   G_CALLBACK(on_key_press), NULL);
-  g_signal_connect(G_OBJECT(window), "key_release_event",
-                   G_CALLBACK(on_key_release), NULL);
-  g_signal_connect(G_OBJECT(window), "destroy", G_CALLBACK(gtk_main_quit),
-                   NULL);
-  if (options.frame_rate) {
-    g_timeout_add(options.frame_rate, (GSourceFunc)timeout_handler, window);
-  } else {
-    g_idle_add((GSourceFunc)timeout_handler, window);
+  struct {
+    RomImage &Image;
+    const char *Path;
+    const char *Default;
+    size_t Size;
+  } ROMs[] = {{KernalROM, options.rom_kernal, "kernal.901227-03.bin", 8192},
+              {BasicROM, options.rom_basic, "basic.901226-01.bin", 8192},
+              {CharROM, options.rom_char, "characters.901225-01.bin", 4096}};
+  for (auto &ROM : ROMs) {
+    std::string Path = ROM.Path ? ROM.Path : default_rom_path(ROM.Default);
+    if (!ROM.Image.map(Path.c_str(), ROM.Size)) {
+      fprintf(stderr, "Unable to load %zu byte ROM image '%s'\n", ROM.Size,
+              Path.c_str());
+      if (!ROM.Path)
+        fprintf(stderr, "The default ROM images are fetched into roms/ by "
+                        "roms/fetch-roms.sh\n");
+      exit(1);
+    }
   }
 
-  gtk_window_set_position(GTK_WINDOW(window), GTK_WIN_POS_CENTER);
-  gtk_window_set_default_size(GTK_WINDOW(window), XRES * options.scale,
-                              YRES * options.scale);
-  gtk_window_set_title(GTK_WINDOW(window), argv[0]);
+  if (options.run_jobs_file)
+    return run_jobs();
 
-  gtk_widget_show_all(window);
+  if (options.fork_frame >= 0)
+    return run_fork_server();
 
-  FramePixBuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, XRES, YRES);
+  if (options.bench_audio)
+    return run_audio_benchmark();
 
+  Machine *M = new Machine(options.trace);
   // Initialize Verilators variables
-  Verilated::commandArgs(argc, argv);
+  M->Context->commandArgs(argc, argv);
+
+  if (!options.headless) {
+    MainWindow = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+
+    darea = gtk_drawing_area_new();
+    gtk_container_add(GTK_CONTAINER(MainWindow), darea);
+
+    g_signal_connect(G_OBJECT(darea), "draw", G_CALLBACK(on_draw_event), M);
+    g_signal_connect(G_OBJECT(MainWindow), "key_press_event",
+                     G_CALLBACK(on_key_press), M);
+    g_signal_connect(G_OBJECT(MainWindow), "key_release_event",
+                     G_CALLBACK(on_key_release), M);
+    g_signal_connect(G_OBJECT(MainWindow), "destroy",
+                     G_CALLBACK(gtk_main_quit), NULL);
+
+    for (unsigned i = 0; i < 3; i++) {
+      DisplayFrame &F = Display.slot(i);
+      F.PixBuf = gdk_pixbuf_new_from_data(F.RGB.data(), GDK_COLORSPACE_RGB,
+                                          FALSE, 8, F.RGB.width(),
+                                          F.RGB.height(), F.RGB.stride(), NULL,
+                                          NULL);
+    }
 
-  Verilated::traceEverOn(options.trace);
+    gtk_window_set_position(GTK_WINDOW(MainWindow), GTK_WIN_POS_CENTER);
+    gtk_window_set_default_size(GTK_WINDOW(MainWindow), XRES * options.scale,
+                                YRES * options.scale);
+    gtk_window_set_title(GTK_WINDOW(MainWindow), argv[0]);
 
-  dut = new Vmyc64_top;
+    gtk_widget_show_all(MainWindow);
+  }
 
   if (options.trace) {
-    trace = new VerilatedVcdC;
-    dut->trace(trace, 99);
-    trace->open("dump.vcd");
+    M->TraceCtl = &options.trace_ctl;
+    M->TracePath = options.trace_file;
   }
 
-  // Apply five cycles with reset active.
-  dut->rst = 1;
-  for (unsigned i = 0; i < 5; i++) {
-    dut->clk = 1;
-    dut->eval();
-    if (trace)
-      trace->dump(TraceTick++);
-    dut->clk = 0;
-    dut->eval();
-    if (trace)
-      trace->dump(TraceTick++);
-    Cycle++;
+  if (options.flight_recorder) {
+    M->Recorder = new FlightRecorder(options.flight_recorder);
+    M->RecorderTrigger = options.flight_recorder_trigger;
+    M->RecorderPrefix = options.flight_recorder_prefix;
+    M->RecorderBinary = options.flight_recorder_binary;
+    signal(SIGUSR1, on_sigusr1);
+  }
+
+  if (options.drive8_dir)
+    M->Drive8 = new KernalDiskTrap(options.drive8_dir);
+
+  if (!M->Colors.load(options.palette)) {
+    fprintf(stderr, "Unable to load palette '%s'\n", options.palette);
+    exit(1);
+  }
+
+  if (options.load_state_file)
+    loadState(*M, options.load_state_file);
+  else
+    M->reset();
+  for (Command *Cmd : CmdLineCommands)
+    M->Scheduler.add(Cmd);
+
+  // Cycles in the input log are absolute so a replay has to start from the
+  // same state as the recording did.
+  if (options.replay_input) {
+    M->InputReplay = new InputLogReader;
+    if (!M->InputReplay->open(options.replay_input)) {
+      fprintf(stderr, "Unable to read '%s'\n", options.replay_input);
+      exit(1);
+    }
+    if (M->InputReplay->startCycle() != M->Cycle) {
+      fprintf(stderr,
+              "'%s' was recorded from cycle %" PRIu64
+              " but starting at cycle %" PRIu64 "\n",
+              options.replay_input, M->InputReplay->startCycle(), M->Cycle);
+      exit(1);
+    }
+    if (!M->InputReplay->pending()) {
+      delete M->InputReplay;
+      M->InputReplay = nullptr;
+    }
+  }
+
+  if (options.record_input) {
+    M->InputRec = new InputLogWriter;
+    if (!M->InputRec->open(options.record_input, M->Cycle)) {
+      fprintf(stderr, "Unable to open '%s' for writing\n",
+              options.record_input);
+      exit(1);
+    }
+    M->RecordedMask = M->dut->i_keyboard_mask;
+  }
+
+  if (options.save_frame_from != INT_MAX)
+    FrameWriter = new PNGWriter(options.png_threads, 2 * options.png_threads);
+
+  if (options.video_out &&
+      !VideoOut.open(options.video_out, options.video_format, XRES, YRES,
+                     CpuHz, CpuCyclesPerFrame)) {
+    fprintf(stderr, "Unable to open '%s' for writing\n", options.video_out);
+    exit(1);
+  }
+
+  if (options.profile_file || options.profile_frames_file) {
+    if (!options.profile_file)
+      options.profile_file = "-";
+    M->Profile = new CpuProfiler(options.profile_frames_file != nullptr);
+    if (options.profile_labels &&
+        !M->Profile->loadLabels(options.profile_labels)) {
+      fprintf(stderr, "Unable to open '%s'\n", options.profile_labels);
+      exit(1);
+    }
+    if (options.profile_frames_file &&
+        !(ProfileFrames = fopen(options.profile_frames_file, "w"))) {
+      fprintf(stderr, "Unable to open '%s' for writing\n",
+              options.profile_frames_file);
+      exit(1);
+    }
   }
-  dut->rst = 0;
 
+  if (options.monitor_socket) {
+    Monitor = new DebugMonitor;
+    if (!Monitor->listen(options.monitor_socket)) {
+      fprintf(stderr, "Unable to listen on '%s'\n", options.monitor_socket);
+      exit(1);
+    }
+  }
+
+  if (options.shm_frame) {
+    ShmOut = new ShmFrameWriter;
+    if (!ShmOut->create(options.shm_frame, XRES, YRES, M->Colors)) {
+      fprintf(stderr, "Unable to create shared memory '%s'\n",
+              options.shm_frame);
+      exit(1);
+    }
+  }
+
+  if (*options.wav_out) {
+    M->Audio = new WAVWriter;
+    if (!M->Audio->open(options.wav_out, options.audio_rate)) {
+      fprintf(stderr, "Unable to open '%s' for writing\n", options.wav_out);
+      exit(1);
+    }
+    M->AudioFilter =
+        new AudioDecimator(ModelClockHz, 8, options.audio_rate);
+  }
+
+  if (options.rewind_seconds)
+    Rewind = new RewindBuffer(options.rewind_seconds * 50,
+                              (size_t)options.rewind_mb << 20);
+
+  if (options.hash_log || options.hash_golden) {
+    HashLog = new FrameHashLog;
+    if (options.hash_log && !HashLog->openOutput(options.hash_log)) {
+      fprintf(stderr, "Unable to open '%s' for writing\n", options.hash_log);
+      exit(1);
+    }
+    if (options.hash_golden && !HashLog->openGolden(options.hash_golden)) {
+      fprintf(stderr, "Unable to read '%s'\n", options.hash_golden);
+      exit(1);
+    }
+    M->Hashes = new FrameHash;
+  }
+
+  if (options.stats) {
+    Stats = new PerfStats;
+    StatIds.Eval = Stats->addBucket("eval");
+    StatIds.ClkCb = Stats->addBucket("clk_cb");
+    StatIds.Commands = Stats->addBucket("commands+keys");
+    StatIds.Output = Stats->addBucket("frame output");
+    StatIds.Draw = Stats->addBucket("gtk draw");
+    StatIds.Cycles = Stats->addCounter("cycles");
+    StatIds.Frames = Stats->addCounter("frames");
+    M->CollectStats = true;
+  }
+
+  SimStartTime = std::chrono::steady_clock::now();
+
+  if (options.realtime)
+    Pacer = new FramePacer(ModelClockHz);
+
+  if (options.headless) {
+    if (Pacer)
+      Pacer->start(M->Cycle);
+    for (;;) {
+      if (Monitor && !service_monitor(*M))
+        break;
+      if (!simulate_frame(*M))
+        break;
+      if (Pacer)
+        Pacer->frame(M->Cycle);
+    }
+    finish_and_exit(*M, ExitStatus);
+  }
+
+  std::thread Sim(sim_thread, M);
   gtk_main();
 
+  // The window was closed or the simulation ended.
+  SimQuit = true;
+  Sim.join();
+  finish_and_exit(*M, ExitStatus);
+
   return 0;
 }
@@ -25,8 +25,12 @@
 #include "Vmyc64_soc_top_spram2phase__D4.h"
 #include "Vmyc64_soc_top_spram__A10_D8.h"
 #include "Vmyc64_soc_top_spram__D4.h"
+#include "frame-capture.h"
+#include "perf-stats.h"
+#include "png-writer.h"
+#include "trace-control.h"
+#include "video-writer.h"
 #include "verilated.h"
-#include "verilated_vcd_c.h"
 #include <assert.h>
 #include <fstream>
 #include <functional>
@@ -37,16 +41,75 @@
 #include <vector>
 
 static Vmyc64_soc_top *dut = NULL;
-static VerilatedVcdC *trace = NULL;
+static TraceFile *trace = NULL;
+static TraceControl *TraceCtl = NULL;
+static bool Tracing = false;
 static unsigned TraceTick = 0;
 
+static struct {
+  bool save_vicii_frames;
+  bool save_vga_frames;
+  int save_frame_every;
+  int png_threads;
+  const char *video_out;
+  VideoWriter::Format video_format;
+  bool video_from_vga;
+  int exit_after_frame;
+  bool stats;
+  int stats_every;
+  const char *stats_json;
+  bool trace;
+  TraceControl trace_ctl;
+  const char *trace_file;
+} options;
+
+static PNGWriter *FrameWriter;
+static VideoWriter VideoOut;
+static PerfStats *Stats;
+static bool ExitRequested = false;
+static bool StatsReportDue = false;
+
 double sc_time_stamp() { return TraceTick; }
 
+// Decide whether to trace the coming 15 MHz cycle, see TraceControl. The
+// file is opened when tracing first starts and closed once the window has
+// passed.
+static void update_trace(uint64_t Cycle, unsigned FrameIdx) {
+  if (TraceCtl->waitingForTrigger()) {
+    Vmyc64_soc_top_myc64_top *C64 = dut->myc64_soc_top->u_myc64;
+    if (C64->clk_1mhz_ph1_en && C64->vic_ba)
+      TraceCtl->busCycle(Cycle, C64->cpu_addr, C64->cpu_do, C64->cpu_we);
+  }
+  if (TraceCtl->finished(Cycle, FrameIdx)) {
+    if (trace) {
+      trace->close();
+      delete trace;
+      trace = NULL;
+      fprintf(stderr, "Trace closed at 15 MHz cycle %llu\n",
+              (unsigned long long)Cycle);
+    }
+    TraceCtl = NULL;
+    Tracing = false;
+    return;
+  }
+  Tracing = TraceCtl->active(Cycle, FrameIdx);
+  if (Tracing && !trace) {
+    trace = new TraceFile;
+    trace->set_time_unit("1ps");
+    trace->set_time_resolution("1ps");
+    dut->trace(trace, 99);
+    trace->open(options.trace_file);
+    fprintf(stderr, "Trace opened at 15 MHz cycle %llu\n",
+            (unsigned long long)Cycle);
+  }
+}
+
 class ClockManager {
   using ClockCB = std::function<void(void)>;
   struct Clock {
     Clock(CData *clk_net, double freq, uint64_t offset_ps, ClockCB CallBack) {
       m_clk_net = clk_net;
+      m_freq = freq;
       m_cycle_time_ps = 1e12 / freq;
       m_next_time_ps = offset_ps;
       m_CallBack = CallBack;
@@ -56,10 +119,16 @@ class ClockManager {
     uint64_t m_cycle_time_ps;
     uint64_t m_next_time_ps;
     ClockCB m_CallBack;
+    // Stats buckets and counter, see enableStats().
+    unsigned m_EvalBucket;
+    unsigned m_CallBackBucket;
+    unsigned m_EdgeCounter;
+    uint64_t m_Edges = 0;
   };
 
   std::vector<Clock> m_Clocks;
   uint64_t m_CurrTimePS = 0;
+  PerfStats *m_Stats = nullptr;
 
   Clock *getNext() {
     Clock *FirstClock = &m_Clocks[0];
@@ -74,123 +143,105 @@ public:
                 ClockCB CallBack = std::function<void(void)>()) {
     m_Clocks.emplace_back(Clock(clk_net, freq, offset_ps, CallBack));
   }
+  // Charge eval() and callback time per clock domain to Stats.
+  void enableStats(PerfStats *Stats) {
+    m_Stats = Stats;
+    for (Clock &C : m_Clocks) {
+      char Name[32];
+      snprintf(Name, sizeof(Name), "%gMHz", C.m_freq / 1e6);
+      C.m_EvalBucket = Stats->addBucket(std::string("eval ") + Name);
+      C.m_CallBackBucket = Stats->addBucket(std::string("callback ") + Name);
+      C.m_EdgeCounter = Stats->addCounter(std::string("edges ") + Name);
+    }
+  }
+  void updateStats() {
+    for (Clock &C : m_Clocks)
+      m_Stats->setCounter(C.m_EdgeCounter, C.m_Edges);
+    m_Stats->setSimSeconds(m_CurrTimePS / 1e12);
+  }
   void doWork() {
     Clock *C = getNext();
+    uint64_t T0 = m_Stats ? PerfStats::now() : 0;
     dut->eval();
     dut->eval();
-    if (trace)
+    if (Tracing)
       trace->dump(m_CurrTimePS);
     m_CurrTimePS = C->m_next_time_ps;
     *C->m_clk_net = !(*C->m_clk_net);
     dut->eval();
     dut->eval();
-    if (trace)
+    if (Tracing)
       trace->dump(m_CurrTimePS);
     C->m_next_time_ps += C->m_cycle_time_ps / 2;
 
+    uint64_t T1 = m_Stats ? PerfStats::now() : 0;
     if (C->m_CallBack)
       C->m_CallBack();
+
+    if (m_Stats) {
+      m_Stats->charge(C->m_EvalBucket, T1 - T0);
+      m_Stats->charge(C->m_CallBackBucket, PerfStats::now() - T1);
+      C->m_Edges++;
+    }
   }
 };
 
-static void put_pixel(GdkPixbuf *pixbuf, int x, int y, guchar red, guchar green,
-                      guchar blue) {
-  int width, height, rowstride, n_channels;
-  guchar *pixels, *p;
-
-  n_channels = gdk_pixbuf_get_n_channels(pixbuf);
-
-  g_assert(gdk_pixbuf_get_colorspace(pixbuf) == GDK_COLORSPACE_RGB);
-  g_assert(gdk_pixbuf_get_bits_per_sample(pixbuf) == 8);
-  g_assert(!gdk_pixbuf_get_has_alpha(pixbuf));
-  g_assert(n_channels == 3);
-
-  width = gdk_pixbuf_get_width(pixbuf);
-  height = gdk_pixbuf_get_height(pixbuf);
-
-  g_assert(x >= 0 && x < width);
-  g_assert(y >= 0 && y < height);
-
-  rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-  pixels = gdk_pixbuf_get_pixels(pixbuf);
-
-  p = pixels + y * rowstride + x * n_channels;
-  p[0] = red;
-  p[1] = green;
-  p[2] = blue;
-}
-
 struct VICIIFrameDumper {
-  VICIIFrameDumper() {
-    m_FramePixBuf =
-        gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, c_Xres, c_Yres);
-  }
+  VICIIFrameDumper() : m_Raster(c_Xres, c_Yres, 70, 10) {}
   void operator()() {
     if (dut->clk_15mhz) {
-      bool FrameDone = false;
-
-      if (dut->myc64_soc_top->hsync) {
-        m_HCntr = 0;
-        m_VCntr++;
-      }
-      if (dut->myc64_soc_top->vsync) {
-        m_VCntr = 0;
-        FrameDone = true;
-      }
-
-      unsigned m_HCntrShifted = m_HCntr - 70;
-      unsigned m_VCntrShifted = m_VCntr - 10;
-      if (0 <= m_HCntrShifted && m_HCntrShifted < c_Xres &&
-          0 <= m_VCntrShifted && m_VCntrShifted < c_Yres) {
-        guchar Red = dut->myc64_soc_top->c64_color_rgb >> 16;
-        guchar Green = dut->myc64_soc_top->c64_color_rgb >> 8;
-        guchar Blue = dut->myc64_soc_top->c64_color_rgb & 0xff;
-        put_pixel(m_FramePixBuf, m_HCntrShifted, m_VCntrShifted, Red, Green,
-                  Blue);
-      }
-
-      m_HCntr++;
-
-      if (FrameDone) {
-        char buf[32];
-        snprintf(buf, sizeof(buf), "vicii-%03d.png", m_FrameIdx++);
-        gdk_pixbuf_save(m_FramePixBuf, buf, "png", NULL, NULL);
+      if (TraceCtl)
+        update_trace(m_Cycle++, m_FrameIdx);
+      if (m_Raster.clock(dut->myc64_soc_top->hsync, dut->myc64_soc_top->vsync,
+                         dut->myc64_soc_top->c64_color_rgb)) {
+        if (options.save_vicii_frames &&
+            m_FrameIdx % options.save_frame_every == 0) {
+          char buf[32];
+          snprintf(buf, sizeof(buf), "vicii-%03d.png", m_FrameIdx);
+          FrameWriter->write(m_Raster.frame(), buf);
+        }
+        if (VideoOut.isOpen() && !options.video_from_vga)
+          VideoOut.write(m_Raster.frame());
+        m_FrameIdx++;
+        if (trace)
+          trace->flush();
+        if (options.stats_every && m_FrameIdx % options.stats_every == 0)
+          StatsReportDue = true;
+        if ((int)m_FrameIdx > options.exit_after_frame)
+          ExitRequested = true;
       }
     }
   }
 
 private:
-  const unsigned c_Xres = 504;
-  const unsigned c_Yres = 312;
-  GdkPixbuf *m_FramePixBuf;
+  static const unsigned c_Xres = 504;
+  static const unsigned c_Yres = 312;
+  RasterCapture m_Raster;
   unsigned m_FrameIdx = 0;
-  unsigned m_HCntr = 0;
-  unsigned m_VCntr = 0;
+  uint64_t m_Cycle = 0;
 };
 
 struct VGAFrameDumper {
-  VGAFrameDumper() {
-    m_FramePixBuf =
-        gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, c_Xres, c_Yres);
-  }
+  VGAFrameDumper() : m_Frame(c_Xres, c_Yres) {}
   void operator()() {
     if (dut->clk_25mhz) {
       if (!prev_vga_vsync && dut->o_vga_vsync) {
-        char buf[32];
-        snprintf(buf, sizeof(buf), "vga-%03d.png", m_FrameIdx++);
-        gdk_pixbuf_save(m_FramePixBuf, buf, "png", NULL, NULL);
+        if (options.save_vga_frames &&
+            m_FrameIdx % options.save_frame_every == 0) {
+          char buf[32];
+          snprintf(buf, sizeof(buf), "vga-%03d.png", m_FrameIdx);
+          FrameWriter->write(m_Frame, buf);
+        }
+        if (VideoOut.isOpen() && options.video_from_vga)
+          VideoOut.write(m_Frame);
+        m_FrameIdx++;
         m_X = 0;
         m_Y = 0;
       } else if (!prev_vga_hsync && dut->o_vga_hsync) {
         m_X = 0;
         m_Y++;
       } else if (!dut->o_vga_blank) {
-        guchar red = dut->o_vga_color_rgb >> 16;
-        guchar green = dut->o_vga_color_rgb >> 8;
-        guchar blue = dut->o_vga_color_rgb & 0xff;
-        if (m_X < c_Xres && m_Y < c_Yres) {
-          put_pixel(m_FramePixBuf, m_X, m_Y, red, green, blue);
-        }
+        m_Frame.putPixel(m_X, m_Y, dut->o_vga_color_rgb);
         m_X++;
       }
       prev_vga_hsync = dut->o_vga_hsync;
@@ -199,9 +250,9 @@ struct VGAFrameDumper {
   }
 
 private:
-  const unsigned c_Xres = 640;
-  const unsigned c_Yres = 480;
-  GdkPixbuf *m_FramePixBuf;
+  static const unsigned c_Xres = 640;
+  static const unsigned c_Yres = 480;
+  FrameBuffer m_Frame;
   unsigned m_FrameIdx = 0;
   unsigned m_X = 0;
   unsigned m_Y = 0;
@@ -209,21 +260,141 @@ private:
   int prev_vga_vsync = 0;
 };
 
+static void print_usage(const char *prog) {
+  // clang-format off
+  fprintf(stderr, "Usage: %s [OPTIONS]\n\n", prog);
+  fprintf(stderr, "  --save-frames=S       -- dump frames to .png from S (none, vicii, vga or both)\n");
+  fprintf(stderr, "  --save-frame-every=N  -- only dump every Nth frame\n");
+  fprintf(stderr, "  --png-threads=N       -- number of threads compressing dumped frames\n");
+  fprintf(stderr, "  --video-out=<FILE>    -- stream all frames to <FILE> (- for stdout)\n");
+  fprintf(stderr, "  --video-format=S      -- format of --video-out, y4m (default) or rgb\n");
+  fprintf(stderr, "  --video-source=S      -- frames to stream, vicii (default) or vga\n");
+  fprintf(stderr, "  --exit-after-frame=N  -- exit after VIC-II frame #N\n");
+  fprintf(stderr, "  --stats               -- report host time per clock domain on exit\n");
+  fprintf(stderr, "  --stats-every=N       -- also report every N VIC-II frames (implies --stats)\n");
+  fprintf(stderr, "  --stats-json=<FILE>   -- also write final report as JSON (implies --stats)\n");
+  fprintf(stderr, "  --trace               -- trace the whole run to " TRACE_FILE_DEFAULT "\n");
+  fprintf(stderr, "  --trace-frames=A:B    -- only trace VIC-II frames #A to #B (either may be omitted)\n");
+  fprintf(stderr, "  --trace-cycles=A:B    -- only trace 15 MHz cycles #A to #B (either may be omitted)\n");
+  fprintf(stderr, "  --trace-trigger=T     -- start tracing on C64 CPU bus access, addr:<ADDR> or write:<ADDR>[=<DATA>]\n");
+  fprintf(stderr, "  --trace-length=N      -- 15 MHz cycles to trace after --trace-trigger (default 100000)\n");
+  fprintf(stderr, "  --trace-file=<FILE>   -- trace to <FILE> instead of " TRACE_FILE_DEFAULT "\n");
+  fprintf(stderr, "\n");
+  // clang-format on
+}
+
+static void parse_cmd_args(int argc, char *argv[]) {
+  int off;
+#define MATCH(x) (!strncmp(argv[i], x, strlen(x)) && (off = strlen(x)))
+  for (int i = 1; i < argc; i++) {
+    if (MATCH("--save-frames=")) {
+      const char *S = &argv[i][off];
+      options.save_vicii_frames = !strcmp(S, "vicii") || !strcmp(S, "both");
+      options.save_vga_frames = !strcmp(S, "vga") || !strcmp(S, "both");
+      if (!options.save_vicii_frames && !options.save_vga_frames &&
+          strcmp(S, "none")) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+    } else if (MATCH("--save-frame-every=")) {
+      options.save_frame_every = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--png-threads=")) {
+      options.png_threads = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--video-out=")) {
+      options.video_out = &argv[i][off];
+    } else if (MATCH("--video-format=")) {
+      // Only the C64 core has color indices (and not the VGA output).
+      if (!VideoWriter::parseFormat(&argv[i][off], options.video_format) ||
+          options.video_format == VideoWriter::IDX4) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+    } else if (MATCH("--video-source=")) {
+      const char *S = &argv[i][off];
+      options.video_from_vga = !strcmp(S, "vga");
+      if (!options.video_from_vga && strcmp(S, "vicii")) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+    } else if (MATCH("--exit-after-frame=")) {
+      options.exit_after_frame = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--stats-every=")) {
+      options.stats = true;
+      options.stats_every = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--stats-json=")) {
+      options.stats = true;
+      options.stats_json = &argv[i][off];
+    } else if (MATCH("--stats")) {
+      options.stats = true;
+    } else if (MATCH("--trace-frames=") &&
+               options.trace_ctl.setFrames(&argv[i][off])) {
+      options.trace = true;
+    } else if (MATCH("--trace-cycles=") &&
+               options.trace_ctl.setCycles(&argv[i][off])) {
+      options.trace = true;
+    } else if (MATCH("--trace-trigger=") &&
+               options.trace_ctl.setTrigger(&argv[i][off])) {
+      options.trace = true;
+    } else if (MATCH("--trace-length=")) {
+      options.trace_ctl.setLength(strtoull(&argv[i][off], NULL, 0));
+    } else if (MATCH("--trace-file=")) {
+      options.trace = true;
+      options.trace_file = &argv[i][off];
+    } else if (!strcmp(argv[i], "--trace")) {
+      options.trace = true;
+    } else {
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+#undef MATCH
+  if (options.save_frame_every < 1 || options.png_threads < 1) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+}
+
 int main(int argc, char *argv[]) {
-  bool TraceOn = false;
+  // Set default options.
+  options.save_vicii_frames = true;
+  options.save_vga_frames = true;
+  options.save_frame_every = 1;
+  options.png_threads = 2;
+  options.video_out = nullptr;
+  options.video_format = VideoWriter::Y4M;
+  options.video_from_vga = false;
+  options.exit_after_frame = INT_MAX;
+  options.stats = false;
+  options.stats_every = 0;
+  options.stats_json = nullptr;
+  options.trace = false;
+  options.trace_file = TRACE_FILE_DEFAULT;
+
+  parse_cmd_args(argc, argv);
+
+  if (options.video_out) {
+    bool Ok = options.video_from_vga
+                  ? VideoOut.open(options.video_out, options.video_format,
+                                  640, 480, 60)
+                  : VideoOut.open(options.video_out, options.video_format,
+                                  504, 312, 50);
+    if (!Ok) {
+      fprintf(stderr, "Unable to open '%s' for writing\n", options.video_out);
+      exit(1);
+    }
+  }
+
+  if (options.save_vicii_frames || options.save_vga_frames)
+    FrameWriter = new PNGWriter(options.png_threads, 2 * options.png_threads);
+
   // Initialize Verilators variables
   Verilated::commandArgs(argc, argv);
-  Verilated::traceEverOn(TraceOn);
+  Verilated::traceEverOn(options.trace);
 
   dut = new Vmyc64_soc_top;
 
-  if (TraceOn) {
-    trace = new VerilatedVcdC;
-    trace->set_time_unit("1ps");
-    trace->set_time_resolution("1ps");
-    dut->trace(trace, 99);
-    trace->open("dump.vcd");
-  }
+  if (options.trace)
+    TraceCtl = &options.trace_ctl;
 
   VICIIFrameDumper myVICIIFrameDumper;
   VGAFrameDumper myVGAFrameDumper;
@@ -233,12 +404,15 @@ int main(int argc, char *argv[]) {
   CM.addClock(&dut->clk_25mhz, 25e6, 6000, myVGAFrameDumper);
   CM.addClock(&dut->clk_125mhz, 125e6, 7000);
 
+  if (options.stats) {
+    Stats = new PerfStats;
+    CM.enableStats(Stats);
+  }
+
   dut->rst_15mhz = 1;
   dut->rst_25mhz = 1;
   dut->rst_125mhz = 1;
   dut->eval();
-  if (trace)
-    trace->dump(0);
 
 #if 1
   // Initialize Screen RAM (area) and Color RAM with pattern.
@@ -256,15 +430,38 @@ int main(int argc, char *argv[]) {
 #endif
 
   unsigned idx = 0;
-  while (!Verilated::gotFinish()) {
+  while (!Verilated::gotFinish() && !ExitRequested) {
     if (idx++ > 32) {
       dut->rst_15mhz = 0;
       dut->rst_25mhz = 0;
       dut->rst_125mhz = 0;
     }
     CM.doWork();
-    if (trace)
-      trace->flush();
+    if (StatsReportDue) {
+      StatsReportDue = false;
+      CM.updateStats();
+      Stats->report(stderr);
+    }
+  }
+
+  delete FrameWriter;
+  VideoOut.close();
+  if (trace)
+    trace->close();
+
+  if (Stats) {
+    CM.updateStats();
+    Stats->report(stderr);
+    if (options.stats_json) {
+      FILE *fp = fopen(options.stats_json, "w");
+      if (fp) {
+        Stats->reportJSON(fp);
+        fclose(fp);
+      } else {
+        fprintf(stderr, "Unable to open '%s' for writing\n",
+                options.stats_json);
+      }
+    }
   }
 
   return 0;
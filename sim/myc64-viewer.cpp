@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+// Shows the frames that a myc64-sim started with --shm-frame=<NAME> publishes
+// and passes the keyboard back to it.
+
+#include "frame-capture.h"
+#include "shm-frame.h"
+#include <cairo.h>
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct {
+  const char *C64Key;
+  uint8_t PAIdx;
+  uint8_t PBIdx;
+  uint16_t KeyCode;
+} KeyInfo[] = {
+#define DEF_KEY(a, b, c, d, e, f) {a, b, c, d},
+#include "keys.def"
+#undef DEF_KEY
+};
+
+static struct {
+  int scale;
+  int poll_ms;
+  const char *name;
+} options;
+
+static ShmFrameReader Shm;
+static IndexedFrame *Frame;
+static FrameBuffer *RGBFrame;
+static GdkPixbuf *FramePixBuf;
+static Palette Colors;
+static int FrameIdx = -1;
+static uint64_t SimKeyboardMask;
+static uint64_t KeyboardMask;
+static GtkWidget *MainWindow;
+
+static gboolean on_draw_event(GtkWidget *widget, cairo_t *cr,
+                              gpointer user_data) {
+  (void)widget;
+  (void)user_data;
+  cairo_scale(cr, options.scale, options.scale);
+  gdk_cairo_set_source_pixbuf(cr, FramePixBuf, 0.0, 0.0);
+  cairo_paint(cr);
+  cairo_fill(cr);
+
+  /* Draw some text */
+  cairo_identity_matrix(cr);
+  cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL,
+                         CAIRO_FONT_WEIGHT_NORMAL);
+  cairo_set_font_size(cr, 20);
+  cairo_set_source_rgb(cr, 255, 255, 255);
+  cairo_move_to(cr, 10, 15);
+  char buf[64];
+  snprintf(buf, sizeof(buf), "Frame #%03d, KeyboardMask=0x%016lx", FrameIdx,
+           SimKeyboardMask);
+  cairo_show_text(cr, buf);
+
+  return FALSE;
+}
+
+static gboolean on_key_press(GtkWidget *widget, GdkEventKey *event,
+                             gpointer user_data) {
+  (void)widget;
+  (void)user_data;
+  for (int i = 0; i < sizeof(KeyInfo) / sizeof(KeyInfo[0]); i++) {
+    if (KeyInfo[i].KeyCode == event->hardware_keycode) {
+      int pa = KeyInfo[i].PAIdx;
+      int pb = KeyInfo[i].PBIdx;
+      uint64_t mask = 1ULL << (pa * 8 + pb);
+      KeyboardMask |= mask;
+      break;
+    }
+  }
+  Shm.setKeyboardMask(KeyboardMask);
+  return FALSE;
+}
+
+static gboolean on_key_release(GtkWidget *widget, GdkEventKey *event,
+                               gpointer user_data) {
+  (void)widget;
+  (void)user_data;
+  for (int i = 0; i < sizeof(KeyInfo) / sizeof(KeyInfo[0]); i++) {
+    if (KeyInfo[i].KeyCode == event->hardware_keycode) {
+      int pa = KeyInfo[i].PAIdx;
+      int pb = KeyInfo[i].PBIdx;
+      uint64_t mask = 1ULL << (pa * 8 + pb);
+      KeyboardMask &= ~mask;
+      break;
+    }
+  }
+  Shm.setKeyboardMask(KeyboardMask);
+  return FALSE;
+}
+
+// Nothing is sent from the simulator, just look for a new frame now and then.
+static gboolean timeout_handler(gpointer user_data) {
+  (void)user_data;
+  if (Shm.read(*Frame, FrameIdx, SimKeyboardMask)) {
+    Colors.expand(*Frame, *RGBFrame);
+    gtk_widget_queue_draw(MainWindow);
+  }
+  return TRUE;
+}
+
+static void print_usage(const char *prog) {
+  // clang-format off
+  fprintf(stderr, "Usage: %s [OPTIONS] [NAME]\n\n", prog);
+  fprintf(stderr, "Show the frames of a myc64-sim run with --shm-frame=NAME (default /myc64).\n\n");
+  fprintf(stderr, "  --scale=N             -- set pixel scaling\n");
+  fprintf(stderr, "  --poll=N              -- look for a new frame every N ms (default 10)\n");
+  // clang-format on
+}
+
+static void bad_arg(const char *prog) {
+  print_usage(prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  options.scale = 3;
+  options.poll_ms = 10;
+  options.name = "/myc64";
+
+  int off;
+#define MATCH(x) (!strncmp(argv[i], x, strlen(x)) && (off = strlen(x)))
+  for (int i = 1; i < argc; i++) {
+    if (MATCH("--scale=")) {
+      options.scale = strtol(&argv[i][off], NULL, 0);
+    } else if (MATCH("--poll=")) {
+      options.poll_ms = strtol(&argv[i][off], NULL, 0);
+      if (options.poll_ms < 1)
+        bad_arg(argv[0]);
+    } else if (MATCH("--help")) {
+      print_usage(argv[0]);
+      exit(0);
+    } else if (argv[i][0] != '-') {
+      options.name = argv[i];
+    } else {
+      bad_arg(argv[0]);
+    }
+  }
+#undef MATCH
+
+  if (!Shm.open(options.name)) {
+    fprintf(stderr, "Unable to attach to shared memory '%s'\n", options.name);
+    exit(1);
+  }
+  Colors.set(Shm.palette());
+  Frame = new IndexedFrame(Shm.width(), Shm.height());
+  RGBFrame = new FrameBuffer(Shm.width(), Shm.height());
+  // Keys held in the simulator by an earlier viewer are released.
+  Shm.setKeyboardMask(0);
+
+  gtk_init(&argc, &argv);
+
+  FramePixBuf = gdk_pixbuf_new_from_data(
+      RGBFrame->data(), GDK_COLORSPACE_RGB, FALSE, 8, RGBFrame->width(),
+      RGBFrame->height(), RGBFrame->stride(), NULL, NULL);
+
+  MainWindow = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+  GtkWidget *darea = gtk_drawing_area_new();
+  gtk_container_add(GTK_CONTAINER(MainWindow), darea);
+
+  g_signal_connect(G_OBJECT(darea), "draw", G_CALLBACK(on_draw_event), NULL);
+  g_signal_connect(G_OBJECT(MainWindow), "key_press_event",
+                   G_CALLBACK(on_key_press), NULL);
+  g_signal_connect(G_OBJECT(MainWindow), "key_release_event",
+                   G_CALLBACK(on_key_release), NULL);
+  g_signal_connect(G_OBJECT(MainWindow), "destroy",
+                   G_CALLBACK(gtk_main_quit), NULL);
+  g_timeout_add(options.poll_ms, timeout_handler, NULL);
+
+  gtk_window_set_position(GTK_WINDOW(MainWindow), GTK_WIN_POS_CENTER);
+  gtk_window_set_default_size(GTK_WINDOW(MainWindow),
+                              Shm.width() * options.scale,
+                              Shm.height() * options.scale);
+  gtk_window_set_title(GTK_WINDOW(MainWindow), options.name);
+
+  gtk_widget_show_all(MainWindow);
+
+  gtk_main();
+
+  // Do not leave keys pressed in the simulator.
+  Shm.setKeyboardMask(0);
+
+  return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Host time accounting for the simulators. Time is split into named buckets
+// that are charged with the difference of two now() readings; on x86 these
+// come from the TSC (calibrated against the wall clock when reporting) so
+// that timing every simulated cycle stays cheap. Counters are plain named
+// totals such as cycles or frames that are reported as rates.
+class PerfStats {
+public:
+  PerfStats() : m_WallStart(std::chrono::steady_clock::now()) {
+    m_TickStart = now();
+  }
+
+  static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  unsigned addBucket(const std::string &Name) {
+    m_Buckets.push_back(Bucket{Name, 0, 0});
+    return m_Buckets.size() - 1;
+  }
+
+  void charge(unsigned Bucket, uint64_t Ticks) {
+    m_Buckets[Bucket].m_Ticks += Ticks;
+    m_Buckets[Bucket].m_Calls++;
+  }
+
+  // For time accounted elsewhere, e.g. on another thread, and handed over
+  // as totals.
+  void setBucket(unsigned Bucket, uint64_t Ticks, uint64_t Calls) {
+    m_Buckets[Bucket].m_Ticks = Ticks;
+    m_Buckets[Bucket].m_Calls = Calls;
+  }
+
+  unsigned addCounter(const std::string &Name) {
+    m_Counters.push_back(Counter{Name, 0});
+    return m_Counters.size() - 1;
+  }
+
+  void setCounter(unsigned Counter, uint64_t Value) {
+    m_Counters[Counter].m_Value = Value;
+  }
+
+  // Simulated time, used to report how far from real time the model is.
+  void setSimSeconds(double Seconds) { m_SimSeconds = Seconds; }
+
+  void report(FILE *fp) {
+    double Wall = wallSeconds();
+    double TicksPerSecond = (now() - m_TickStart) / Wall;
+    fprintf(fp, "=== Performance after %.2f s ===\n", Wall);
+    if (m_SimSeconds > 0)
+      fprintf(fp, "  %-20s %12.4f s (%.4fx real time)\n", "simulated",
+              m_SimSeconds, m_SimSeconds / Wall);
+    for (Counter &C : m_Counters)
+      fprintf(fp, "  %-20s %12llu (%.1f/s)\n", C.m_Name.c_str(),
+              (unsigned long long)C.m_Value, C.m_Value / Wall);
+    for (Bucket &B : m_Buckets) {
+      double Seconds = B.m_Ticks / TicksPerSecond;
+      fprintf(fp, "  %-20s %12.4f s %5.1f%% %12llu calls %10.1f ns/call\n",
+              B.m_Name.c_str(), Seconds, 100.0 * Seconds / Wall,
+              (unsigned long long)B.m_Calls,
+              B.m_Calls ? Seconds / B.m_Calls * 1e9 : 0.0);
+    }
+    fprintf(fp, "  %-20s %12ld kB\n", "peak RSS", peakRSS());
+  }
+
+  void reportJSON(FILE *fp) {
+    double Wall = wallSeconds();
+    double TicksPerSecond = (now() - m_TickStart) / Wall;
+    fprintf(fp, "{\n  \"wall_seconds\": %.6f,\n", Wall);
+    fprintf(fp, "  \"sim_seconds\": %.6f,\n", m_SimSeconds);
+    fprintf(fp, "  \"peak_rss_kb\": %ld,\n", peakRSS());
+    fprintf(fp, "  \"counters\": {");
+    for (size_t i = 0; i < m_Counters.size(); i++)
+      fprintf(fp, "%s\n    \"%s\": %llu", i ? "," : "",
+              m_Counters[i].m_Name.c_str(),
+              (unsigned long long)m_Counters[i].m_Value);
+    fprintf(fp, "\n  },\n  \"buckets\": {");
+    for (size_t i = 0; i < m_Buckets.size(); i++)
+      fprintf(fp, "%s\n    \"%s\": {\"seconds\": %.6f, \"calls\": %llu}",
+              i ? "," : "", m_Buckets[i].m_Name.c_str(),
+              m_Buckets[i].m_Ticks / TicksPerSecond,
+              (unsigned long long)m_Buckets[i].m_Calls);
+    fprintf(fp, "\n  }\n}\n");
+  }
+
+private:
+  struct Bucket {
+    std::string m_Name;
+    uint64_t m_Ticks;
+    uint64_t m_Calls;
+  };
+  struct Counter {
+    std::string m_Name;
+    uint64_t m_Value;
+  };
+
+  double wallSeconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         m_WallStart)
+        .count();
+  }
+
+  static long peakRSS() {
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+    return Usage.ru_maxrss;
+  }
+
+  std::chrono::steady_clock::time_point m_WallStart;
+  uint64_t m_TickStart;
+  double m_SimSeconds = 0;
+  std::vector<Bucket> m_Buckets;
+  std::vector<Counter> m_Counters;
+};
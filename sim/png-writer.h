@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "frame-capture.h"
+#include <condition_variable>
+#include <deque>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Save a frame as .png. The pixbuf only wraps the frame buffer memory.
+static inline void savePNG(const FrameBuffer &FB, const char *Path) {
+  GdkPixbuf *PixBuf = gdk_pixbuf_new_from_data(
+      FB.data(), GDK_COLORSPACE_RGB, FALSE, 8, FB.width(), FB.height(),
+      FB.stride(), NULL, NULL);
+  gdk_pixbuf_save(PixBuf, Path, "png", NULL, NULL);
+  g_object_unref(PixBuf);
+}
+
+// Compresses and writes frames on a pool of worker threads. The simulation
+// thread only copies the frame into one of a fixed number of buffers; when
+// all of them are waiting to be encoded write() blocks until one is free.
+class PNGWriter {
+public:
+  PNGWriter(unsigned NumThreads, unsigned QueueDepth) {
+    for (unsigned i = 0; i < QueueDepth; i++)
+      m_Free.push_back(new Job);
+    for (unsigned i = 0; i < NumThreads; i++)
+      m_Workers.emplace_back(&PNGWriter::worker, this);
+  }
+
+  // Blocks until all queued frames are written.
+  ~PNGWriter() {
+    {
+      std::lock_guard<std::mutex> Lock(m_Mutex);
+      m_Done = true;
+    }
+    m_PendingCV.notify_all();
+    for (std::thread &T : m_Workers)
+      T.join();
+    for (Job *J : m_Free)
+      delete J;
+  }
+
+  void write(const FrameBuffer &FB, const std::string &Path) {
+    Job *J;
+    {
+      std::unique_lock<std::mutex> Lock(m_Mutex);
+      m_FreeCV.wait(Lock, [this] { return !m_Free.empty(); });
+      J = m_Free.back();
+      m_Free.pop_back();
+    }
+    if (J->m_Frame.width() != FB.width() || J->m_Frame.height() != FB.height())
+      J->m_Frame = FrameBuffer(FB.width(), FB.height());
+    memcpy(J->m_Frame.data(), FB.data(), FB.size());
+    J->m_Path = Path;
+    {
+      std::lock_guard<std::mutex> Lock(m_Mutex);
+      m_Pending.push_back(J);
+    }
+    m_PendingCV.notify_one();
+  }
+
+private:
+  struct Job {
+    Job() : m_Frame(0, 0) {}
+    FrameBuffer m_Frame;
+    std::string m_Path;
+  };
+
+  void worker() {
+    for (;;) {
+      Job *J;
+      {
+        std::unique_lock<std::mutex> Lock(m_Mutex);
+        m_PendingCV.wait(Lock, [this] { return m_Done || !m_Pending.empty(); });
+        if (m_Pending.empty())
+          return;
+        J = m_Pending.front();
+        m_Pending.pop_front();
+      }
+      savePNG(J->m_Frame, J->m_Path.c_str());
+      {
+        std::lock_guard<std::mutex> Lock(m_Mutex);
+        m_Free.push_back(J);
+      }
+      m_FreeCV.notify_one();
+    }
+  }
+
+  std::mutex m_Mutex;
+  std::condition_variable m_PendingCV;
+  std::condition_variable m_FreeCV;
+  std::deque<Job *> m_Pending;
+  std::vector<Job *> m_Free;
+  std::vector<std::thread> m_Workers;
+  bool m_Done = false;
+};
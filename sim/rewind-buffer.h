@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "verilated_save.h"
+#include <algorithm>
+#include <deque>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// Verilator save/restore streams backed by memory instead of a file, they
+// hook into the buffer refill points that VerilatedSave/VerilatedRestore use.
+class MemorySave : public VerilatedSerialize {
+public:
+  MemorySave(std::vector<uint8_t> &Data) : m_Data(Data) {
+    m_Data.clear();
+    m_isOpen = true;
+  }
+  ~MemorySave() override { close(); }
+
+  void close() override {
+    flush();
+    m_isOpen = false;
+  }
+  void flush() override {
+    m_Data.insert(m_Data.end(), m_bufp, m_cp);
+    m_cp = m_bufp;
+  }
+
+private:
+  std::vector<uint8_t> &m_Data;
+};
+
+class MemoryRestore : public VerilatedDeserialize {
+public:
+  MemoryRestore(const std::vector<uint8_t> &Data) : m_Data(Data) {
+    m_endp = m_cp = m_bufp;
+    m_isOpen = true;
+  }
+
+protected:
+  void fill() override {
+    size_t Left = m_endp - m_cp;
+    memmove(m_bufp, m_cp, Left);
+    m_cp = m_bufp;
+    m_endp = m_bufp + Left;
+    size_t N = std::min(bufferSize() - Left, m_Data.size() - m_Pos);
+    memcpy(m_endp, m_Data.data() + m_Pos, N);
+    m_Pos += N;
+    m_endp += N;
+    // Like VerilatedRestore, pad with zeros so that reads need no checks.
+    memset(m_endp, 0, m_bufp + bufferSize() - m_endp);
+    m_endp = m_bufp + bufferSize();
+  }
+
+private:
+  const std::vector<uint8_t> &m_Data;
+  size_t m_Pos = 0;
+};
+
+// A rolling history of serialized machine states, one per frame. Every
+// KeyInterval frames the whole state is kept, the frames in between only
+// keep the byte ranges that differ from that keyframe. Mostly it is RAM and
+// a few registers that change so a delta is typically a few kB.
+//
+// The oldest keyframe and its deltas are dropped once the history covers
+// more than MaxFrames or takes more than MaxBytes.
+class RewindBuffer {
+public:
+  RewindBuffer(unsigned MaxFrames, size_t MaxBytes, unsigned KeyInterval = 50)
+      : m_MaxFrames(MaxFrames), m_MaxBytes(MaxBytes),
+        m_KeyInterval(KeyInterval) {}
+
+  // Frames are pushed in increasing order.
+  void push(int Frame, const std::vector<uint8_t> &State) {
+    const Snapshot *Key = lastKey();
+    Snapshot S;
+    S.m_Frame = Frame;
+    S.m_Key = !Key || Frame - Key->m_Frame >= (int)m_KeyInterval ||
+              Key->m_Data.size() != State.size();
+    if (S.m_Key)
+      S.m_Data = State;
+    else
+      encode(Key->m_Data, State, S.m_Data);
+    m_Bytes += S.m_Data.size();
+    m_Snapshots.push_back(std::move(S));
+
+    while (m_Snapshots.size() > 1 &&
+           (m_Bytes > m_MaxBytes ||
+            Frame - m_Snapshots.front().m_Frame > (int)m_MaxFrames)) {
+      // Keep the group the newest frame belongs to.
+      size_t Next = 1;
+      while (Next < m_Snapshots.size() && !m_Snapshots[Next].m_Key)
+        Next++;
+      if (Next == m_Snapshots.size())
+        break;
+      for (size_t i = 0; i < Next; i++) {
+        m_Bytes -= m_Snapshots.front().m_Data.size();
+        m_Snapshots.pop_front();
+      }
+    }
+  }
+
+  // Rebuild the newest state at or before Frame, or the oldest one if Frame
+  // is older than that. Returns the frame found or -1 if there is none.
+  int get(int Frame, std::vector<uint8_t> &State) const {
+    if (m_Snapshots.empty())
+      return -1;
+    size_t i = m_Snapshots.size() - 1;
+    while (i > 0 && m_Snapshots[i].m_Frame > Frame)
+      i--;
+    size_t k = i;
+    while (!m_Snapshots[k].m_Key)
+      k--;
+    State = m_Snapshots[k].m_Data;
+    if (k != i)
+      decode(m_Snapshots[i].m_Data, State);
+    return m_Snapshots[i].m_Frame;
+  }
+
+  // Forget everything after Frame, used when resuming from an older frame.
+  void truncate(int Frame) {
+    while (!m_Snapshots.empty() && m_Snapshots.back().m_Frame > Frame) {
+      m_Bytes -= m_Snapshots.back().m_Data.size();
+      m_Snapshots.pop_back();
+    }
+  }
+
+  size_t bytes() const { return m_Bytes; }
+
+private:
+  struct Snapshot {
+    int m_Frame;
+    bool m_Key;
+    std::vector<uint8_t> m_Data;
+  };
+
+  const Snapshot *lastKey() const {
+    for (auto It = m_Snapshots.rbegin(); It != m_Snapshots.rend(); ++It)
+      if (It->m_Key)
+        return &*It;
+    return nullptr;
+  }
+
+  // A delta is a sequence of varint(unchanged bytes), varint(N) followed by
+  // the N new bytes. Changes less than eight bytes apart are merged into one
+  // run as that is cheaper than starting a new one.
+  static void encode(const std::vector<uint8_t> &Key,
+                     const std::vector<uint8_t> &State,
+                     std::vector<uint8_t> &Delta) {
+    size_t Size = State.size(), Pos = 0;
+    while (Pos < Size) {
+      size_t Start = Pos;
+      while (Start < Size && Key[Start] == State[Start])
+        Start++;
+      if (Start == Size)
+        break;
+      size_t End = Start + 1, Same = 0;
+      for (; End < Size && Same < 8; End++)
+        Same = Key[End] == State[End] ? Same + 1 : 0;
+      End -= Same;
+      putVarint(Delta, Start - Pos);
+      putVarint(Delta, End - Start);
+      Delta.insert(Delta.end(), &State[Start], &State[0] + End);
+      Pos = End;
+    }
+  }
+
+  static void decode(const std::vector<uint8_t> &Delta,
+                     std::vector<uint8_t> &State) {
+    size_t In = 0, Pos = 0;
+    while (In < Delta.size()) {
+      Pos += getVarint(Delta, In);
+      size_t N = getVarint(Delta, In);
+      memcpy(&State[Pos], &Delta[In], N);
+      In += N;
+      Pos += N;
+    }
+  }
+
+  static void putVarint(std::vector<uint8_t> &Out, size_t Value) {
+    for (; Value >= 0x80; Value >>= 7)
+      Out.push_back(0x80 | (Value & 0x7f));
+    Out.push_back(Value);
+  }
+
+  static size_t getVarint(const std::vector<uint8_t> &In, size_t &Pos) {
+    size_t Value = 0;
+    for (unsigned Shift = 0;; Shift += 7) {
+      uint8_t C = In[Pos++];
+      Value |= (size_t)(C & 0x7f) << Shift;
+      if (!(C & 0x80))
+        return Value;
+    }
+  }
+
+  unsigned m_MaxFrames;
+  size_t m_MaxBytes;
+  unsigned m_KeyInterval;
+  std::deque<Snapshot> m_Snapshots;
+  size_t m_Bytes = 0;
+};
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A raw binary ROM image mapped into memory once and then copied into the
+// ROM array of each model that is created.
+class RomImage {
+public:
+  ~RomImage() {
+    if (m_Data)
+      munmap((void *)m_Data, m_Size);
+  }
+
+  // Fails unless the file is exactly Size bytes.
+  bool map(const char *Path, size_t Size) {
+    int fd = open(Path, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat St;
+    void *Data = MAP_FAILED;
+    if (!fstat(fd, &St) && (size_t)St.st_size == Size)
+      Data = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (Data == MAP_FAILED)
+      return false;
+    m_Data = (const uint8_t *)Data;
+    m_Size = Size;
+    return true;
+  }
+
+  void copyTo(uint8_t *Mem) const {
+    if (m_Data)
+      memcpy(Mem, m_Data, m_Size);
+  }
+
+private:
+  const uint8_t *m_Data = nullptr;
+  size_t m_Size = 0;
+};
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "frame-capture.h"
+#include <atomic>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The latest frame of a simulator in a POSIX shared memory segment, so that
+// a viewer in another process (myc64-viewer) can look at it and type on the
+// keyboard. The simulator never waits for a viewer: the frame is protected by
+// a sequence lock, i.e. m_Seq is odd while the frame is being written and a
+// reader retries if it changed while it copied the frame. The keyboard goes
+// the other way in m_ViewerMask, only one viewer should type at a time.
+struct ShmFrameHeader {
+  static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+                "Atomics must be lock-free to work across processes");
+
+  char m_Magic[8];
+  uint32_t m_Version;
+  uint32_t m_Width;
+  uint32_t m_Height;
+  uint32_t m_Palette[16];
+  std::atomic<uint32_t> m_Seq;
+  // Written together with the frame, under m_Seq.
+  int32_t m_FrameIdx;
+  uint64_t m_KeyboardMask;
+  // Written by the viewer.
+  std::atomic<uint64_t> m_ViewerMask;
+  // Followed by the pixels, an IndexedFrame of m_Width x m_Height.
+
+  static const char *magic() { return "MYC64SHM"; }
+  static const uint32_t Version = 1;
+
+  uint8_t *pixels() { return (uint8_t *)(this + 1); }
+  size_t pixelBytes() const { return (m_Width + 1) / 2 * m_Height; }
+};
+
+class ShmFrameWriter {
+public:
+  ~ShmFrameWriter() {
+    if (m_Header) {
+      munmap(m_Header, m_Size);
+      shm_unlink(m_Name.c_str());
+    }
+  }
+
+  // Name is a shared memory object name such as /myc64. A stale segment of
+  // the same name is replaced, viewers still attached to it keep the old one.
+  bool create(const char *Name, unsigned Width, unsigned Height,
+              const Palette &Colors) {
+    m_Name = Name;
+    shm_unlink(Name);
+    int fd = shm_open(Name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+      return false;
+    m_Size = sizeof(ShmFrameHeader) + (Width + 1) / 2 * Height;
+    void *p = MAP_FAILED;
+    if (!ftruncate(fd, m_Size))
+      p = mmap(nullptr, m_Size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      shm_unlink(Name);
+      return false;
+    }
+    // A fresh segment is all zeros, which is a valid state for the atomics.
+    m_Header = (ShmFrameHeader *)p;
+    m_Header->m_Version = ShmFrameHeader::Version;
+    m_Header->m_Width = Width;
+    m_Header->m_Height = Height;
+    for (unsigned i = 0; i < 16; i++)
+      m_Header->m_Palette[i] = Colors.rgb(i);
+    // Last, a viewer ignores the segment until the magic is there.
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(m_Header->m_Magic, ShmFrameHeader::magic(), 8);
+    return true;
+  }
+
+  void publish(const IndexedFrame &Frame, int FrameIdx, uint64_t KeyboardMask) {
+    uint32_t Seq = m_Header->m_Seq.load(std::memory_order_relaxed);
+    m_Header->m_Seq.store(Seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_Header->m_FrameIdx = FrameIdx;
+    m_Header->m_KeyboardMask = KeyboardMask;
+    memcpy(m_Header->pixels(), Frame.data(), m_Header->pixelBytes());
+    m_Header->m_Seq.store(Seq + 2, std::memory_order_release);
+  }
+
+  uint64_t viewerMask() const {
+    return m_Header->m_ViewerMask.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::string m_Name;
+  ShmFrameHeader *m_Header = nullptr;
+  size_t m_Size = 0;
+};
+
+class ShmFrameReader {
+public:
+  ~ShmFrameReader() {
+    if (m_Header)
+      munmap(m_Header, m_Size);
+  }
+
+  bool open(const char *Name) {
+    int fd = shm_open(Name, O_RDWR, 0);
+    if (fd < 0)
+      return false;
+    struct stat St;
+    void *p = MAP_FAILED;
+    if (!fstat(fd, &St) && (size_t)St.st_size >= sizeof(ShmFrameHeader))
+      p = mmap(nullptr, St.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    m_Header = (ShmFrameHeader *)p;
+    m_Size = St.st_size;
+    if (memcmp(m_Header->m_Magic, ShmFrameHeader::magic(), 8) ||
+        m_Header->m_Version != ShmFrameHeader::Version ||
+        sizeof(ShmFrameHeader) + m_Header->pixelBytes() > m_Size) {
+      munmap(m_Header, m_Size);
+      m_Header = nullptr;
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+  }
+
+  unsigned width() const { return m_Header->m_Width; }
+  unsigned height() const { return m_Header->m_Height; }
+  const uint32_t *palette() const { return m_Header->m_Palette; }
+
+  // Copy the frame if there is a new one since the last call, Frame must be
+  // width() x height().
+  bool read(IndexedFrame &Frame, int &FrameIdx, uint64_t &KeyboardMask) {
+    for (;;) {
+      uint32_t Seq = m_Header->m_Seq.load(std::memory_order_acquire);
+      if (Seq == m_LastSeq)
+        return false;
+      if (Seq & 1)
+        continue;
+      FrameIdx = m_Header->m_FrameIdx;
+      KeyboardMask = m_Header->m_KeyboardMask;
+      memcpy(Frame.data(), m_Header->pixels(), m_Header->pixelBytes());
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (m_Header->m_Seq.load(std::memory_order_relaxed) == Seq) {
+        m_LastSeq = Seq;
+        return true;
+      }
+    }
+  }
+
+  void setKeyboardMask(uint64_t Mask) {
+    m_Header->m_ViewerMask.store(Mask, std::memory_order_relaxed);
+  }
+
+private:
+  ShmFrameHeader *m_Header = nullptr;
+  size_t m_Size = 0;
+  uint32_t m_LastSeq = 0;
+};
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+// Fixed size lock-free queue for exactly one producer and one consumer
+// thread. Size must be a power of two.
+template <class T, size_t Size> class SPSCQueue {
+  static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+
+public:
+  // Returns false, dropping Value, if the queue is full.
+  bool push(const T &Value) {
+    size_t Tail = m_Tail.load(std::memory_order_relaxed);
+    if (Tail - m_Head.load(std::memory_order_acquire) == Size)
+      return false;
+    m_Items[Tail & (Size - 1)] = Value;
+    m_Tail.store(Tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &Value) {
+    size_t Head = m_Head.load(std::memory_order_relaxed);
+    if (Head == m_Tail.load(std::memory_order_acquire))
+      return false;
+    Value = m_Items[Head & (Size - 1)];
+    m_Head.store(Head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  T m_Items[Size];
+  // Kept on separate cache lines as each is written by its own thread.
+  alignas(64) std::atomic<size_t> m_Head{0};
+  alignas(64) std::atomic<size_t> m_Tail{0};
+};
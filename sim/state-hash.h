@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// XXH64 (https://github.com/Cyan4973/xxHash), fast enough to hash all of the
+// RAM and the frame buffer every frame.
+static inline uint64_t xxh64(const void *Data, size_t Len, uint64_t Seed = 0) {
+  static const uint64_t P1 = 0x9e3779b185ebca87ULL, P2 = 0xc2b2ae3d27d4eb4fULL,
+                        P3 = 0x165667b19e3779f9ULL, P4 = 0x85ebca77c2b2ae63ULL,
+                        P5 = 0x27d4eb2f165667c5ULL;
+  auto rotl = [](uint64_t X, int R) { return (X << R) | (X >> (64 - R)); };
+  auto read64 = [](const uint8_t *p) {
+    uint64_t V;
+    memcpy(&V, p, sizeof(V));
+    return V;
+  };
+  auto round = [&](uint64_t Acc, uint64_t In) {
+    return rotl(Acc + In * P2, 31) * P1;
+  };
+  auto merge = [&](uint64_t Acc, uint64_t V) {
+    return (Acc ^ round(0, V)) * P1 + P4;
+  };
+
+  const uint8_t *p = (const uint8_t *)Data, *End = p + Len;
+  uint64_t H;
+  if (Len >= 32) {
+    uint64_t V1 = Seed + P1 + P2, V2 = Seed + P2, V3 = Seed, V4 = Seed - P1;
+    for (; p + 32 <= End; p += 32) {
+      V1 = round(V1, read64(p));
+      V2 = round(V2, read64(p + 8));
+      V3 = round(V3, read64(p + 16));
+      V4 = round(V4, read64(p + 24));
+    }
+    H = rotl(V1, 1) + rotl(V2, 7) + rotl(V3, 12) + rotl(V4, 18);
+    H = merge(merge(merge(merge(H, V1), V2), V3), V4);
+  } else {
+    H = Seed + P5;
+  }
+  H += Len;
+  for (; p + 8 <= End; p += 8)
+    H = rotl(H ^ round(0, read64(p)), 27) * P1 + P4;
+  if (p + 4 <= End) {
+    uint32_t V;
+    memcpy(&V, p, sizeof(V));
+    H = rotl(H ^ (V * P1), 23) * P2 + P3;
+    p += 4;
+  }
+  for (; p < End; p++)
+    H = rotl(H ^ (*p * P5), 11) * P1;
+  H ^= H >> 33;
+  H *= P2;
+  H ^= H >> 29;
+  H *= P3;
+  H ^= H >> 32;
+  return H;
+}
+
+// The hashes taken at the end of a frame. Audio is a running FNV-1a style
+// hash over all SID samples of the frame, fed one sample at a time through
+// addSample() and started from a non-zero seed by resetAudio() so that a
+// frame of silence does not hash to zero.
+struct FrameHash {
+  enum { RAM, ColorRAM, Video, Audio, Num };
+  static const char *name(unsigned i) {
+    static const char *Names[Num] = {"ram", "color", "video", "audio"};
+    return Names[i];
+  }
+
+  static const uint64_t AudioSeed = 0xcbf29ce484222325ULL;
+
+  void addSample(uint16_t Sample) {
+    m_Hash[Audio] = (m_Hash[Audio] ^ Sample) * 0x100000001b3ULL;
+  }
+  void resetAudio() { m_Hash[Audio] = AudioSeed; }
+
+  uint64_t m_Hash[Num] = {0, 0, 0, AudioSeed};
+};
+
+// Writes one line per frame, "<FRAME> <RAM> <COLOR> <VIDEO> <AUDIO>" in hex,
+// and optionally compares each line against the same frame of a golden log
+// written by an earlier run.
+class FrameHashLog {
+public:
+  ~FrameHashLog() {
+    if (m_Out)
+      fclose(m_Out);
+    if (m_Golden)
+      fclose(m_Golden);
+  }
+
+  bool openOutput(const char *Path) {
+    m_Out = fopen(Path, "w");
+    return m_Out != nullptr;
+  }
+
+  bool openGolden(const char *Path) {
+    m_Golden = fopen(Path, "r");
+    return m_Golden != nullptr;
+  }
+
+  void close() {
+    if (m_Out)
+      fclose(m_Out);
+    m_Out = nullptr;
+  }
+
+  // Returns false if Frame differs from the golden log or the golden log
+  // ends before Frame, the differences have then been reported on stderr.
+  bool frame(int Frame, const FrameHash &H) {
+    if (m_Out) {
+      fprintf(m_Out, "%d", Frame);
+      for (unsigned i = 0; i < FrameHash::Num; i++)
+        fprintf(m_Out, " %016" PRIx64, H.m_Hash[i]);
+      fputc('\n', m_Out);
+    }
+    if (!m_Golden)
+      return true;
+
+    int GoldenFrame;
+    FrameHash G;
+    do {
+      if (fscanf(m_Golden, "%d %" SCNx64 " %" SCNx64 " %" SCNx64 " %" SCNx64,
+                 &GoldenFrame, &G.m_Hash[0], &G.m_Hash[1], &G.m_Hash[2],
+                 &G.m_Hash[3]) != 5) {
+        fprintf(stderr, "Golden hash log ends before frame %d\n", Frame);
+        fclose(m_Golden);
+        m_Golden = nullptr;
+        return false;
+      }
+    } while (GoldenFrame < Frame);
+
+    bool Match = true;
+    for (unsigned i = 0; i < FrameHash::Num; i++) {
+      if (GoldenFrame == Frame && G.m_Hash[i] == H.m_Hash[i])
+        continue;
+      if (Match)
+        fprintf(stderr, "Frame %d differs from the golden hash log:", Frame);
+      fprintf(stderr, " %s", FrameHash::name(i));
+      Match = false;
+    }
+    if (!Match)
+      fputc('\n', stderr);
+    return Match;
+  }
+
+private:
+  FILE *m_Out = nullptr;
+  FILE *m_Golden = nullptr;
+};
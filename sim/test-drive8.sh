@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Loads a .prg through the --drive8 KERNAL trap and checks that the file is
+# left untouched, i.e. that the load never ends up in the save trap. Run from
+# sim/ after ./build-myc64-sim.sh.
+
+set -e
+
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+# 10 PRINT"HI"
+printf '\x01\x08\x0b\x08\x0a\x00\x99\x22\x48\x49\x22\x00\x00\x00' > $DIR/test.prg
+cp $DIR/test.prg $DIR/expected.prg
+
+./myc64-sim --headless --drive8=$DIR \
+  --cmd-type-keys=pc=0xa560+1:'LOAD"TEST",8<RETURN>' \
+  --exit-after-frame=400 2> $DIR/log.txt
+
+if ! grep -q "Drive 8: loaded" $DIR/log.txt; then
+  echo "FAIL: nothing was loaded"
+  exit 1
+fi
+if grep -q "Drive 8: saved" $DIR/log.txt; then
+  echo "FAIL: the load ran into the save trap"
+  exit 1
+fi
+if ! cmp -s $DIR/test.prg $DIR/expected.prg; then
+  echo "FAIL: test.prg was modified by the load"
+  exit 1
+fi
+echo "PASS"
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "bus-trigger.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The trace format is fixed when the model is verilated, build with
+// TRACE_FST=1 to get (much smaller) .fst files instead of .vcd.
+#ifdef MYC64_TRACE_FST
+#include "verilated_fst_c.h"
+typedef VerilatedFstC TraceFile;
+#define TRACE_FILE_DEFAULT "dump.fst"
+#else
+#include "verilated_vcd_c.h"
+typedef VerilatedVcdC TraceFile;
+#define TRACE_FILE_DEFAULT "dump.vcd"
+#endif
+
+// Decides which cycles go into the trace file. Tracing can be limited to a
+// window of frames and/or cycles and can be held off until the CPU accesses
+// (or writes) a given address, after which a fixed number of cycles is
+// traced. Once the window has passed for good finished() returns true so
+// that the simulator can close the file and stop asking.
+class TraceControl {
+public:
+  // Parse "A:B", "A:" or ":B" into an inclusive range.
+  static bool parseRange(const char *Str, uint64_t &From, uint64_t &To) {
+    char *EndPtr;
+    From = 0;
+    To = UINT64_MAX;
+    if (*Str != ':') {
+      From = strtoull(Str, &EndPtr, 0);
+      if (EndPtr == Str || *EndPtr != ':')
+        return false;
+      Str = EndPtr;
+    }
+    Str++;
+    if (*Str) {
+      To = strtoull(Str, &EndPtr, 0);
+      if (*EndPtr)
+        return false;
+    }
+    return From <= To;
+  }
+
+  bool setFrames(const char *Str) {
+    return parseRange(Str, m_FromFrame, m_ToFrame);
+  }
+
+  bool setCycles(const char *Str) {
+    return parseRange(Str, m_FromCycle, m_ToCycle);
+  }
+
+  bool setTrigger(const char *Str) { return m_Trigger.parse(Str); }
+
+  void setLength(uint64_t Cycles) { m_Length = Cycles; }
+
+  bool waitingForTrigger() const {
+    return m_Trigger.enabled() && !m_Triggered;
+  }
+
+  // Called for each CPU bus cycle while waitingForTrigger().
+  void busCycle(uint64_t Cycle, uint16_t Addr, uint8_t Data, bool WE) {
+    if (!m_Trigger.match(Addr, Data, WE))
+      return;
+    m_Triggered = true;
+    m_TriggerCycle = Cycle;
+    fprintf(stderr, "Trace triggered at cycle %llu\n",
+            (unsigned long long)Cycle);
+  }
+
+  // Returns true if Cycle, which belongs to frame FrameIdx, is to be traced.
+  bool active(uint64_t Cycle, uint64_t FrameIdx) const {
+    if (Cycle < m_FromCycle || Cycle > m_ToCycle)
+      return false;
+    if (FrameIdx < m_FromFrame || FrameIdx > m_ToFrame)
+      return false;
+    if (!m_Trigger.enabled())
+      return true;
+    return m_Triggered && Cycle - m_TriggerCycle < m_Length;
+  }
+
+  bool finished(uint64_t Cycle, uint64_t FrameIdx) const {
+    return Cycle > m_ToCycle || FrameIdx > m_ToFrame ||
+           (m_Triggered && Cycle - m_TriggerCycle >= m_Length);
+  }
+
+private:
+  uint64_t m_FromFrame = 0;
+  uint64_t m_ToFrame = UINT64_MAX;
+  uint64_t m_FromCycle = 0;
+  uint64_t m_ToCycle = UINT64_MAX;
+  BusTrigger m_Trigger;
+  uint64_t m_Length = 100000;
+  bool m_Triggered = false;
+  uint64_t m_TriggerCycle = 0;
+};
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Hands the latest of a stream of values from one producer thread to one
+// consumer thread without locks and without either side ever waiting. The
+// producer fills back() and publish()es it, the consumer calls acquire() and
+// reads front(). Values that the consumer is too slow to pick up are simply
+// overwritten, it always gets the newest complete one.
+template <class T> class TripleBuffer {
+public:
+  T &slot(unsigned i) { return m_Slots[i]; }
+
+  // Producer side.
+  T &back() { return m_Slots[m_Back]; }
+  void publish() {
+    m_Back = m_Middle.exchange(m_Back | c_Fresh, std::memory_order_acq_rel) &
+             c_IndexMask;
+  }
+
+  // Consumer side, returns true if front() changed.
+  bool acquire() {
+    if (!(m_Middle.load(std::memory_order_relaxed) & c_Fresh))
+      return false;
+    m_Front = m_Middle.exchange(m_Front, std::memory_order_acq_rel) &
+              c_IndexMask;
+    return true;
+  }
+  T &front() { return m_Slots[m_Front]; }
+
+private:
+  static const uint8_t c_IndexMask = 3;
+  static const uint8_t c_Fresh = 4;
+
+  T m_Slots[3];
+  uint8_t m_Back = 0;
+  std::atomic<uint8_t> m_Middle{1};
+  uint8_t m_Front = 2;
+};
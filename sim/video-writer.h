@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "frame-capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Streams frames to a single file (or stdout for "-") that is opened once,
+// either as YUV4MPEG2 (4:4:4, BT.601 limited range) or as raw packed RGB888
+// frames back to back. Both can be piped straight into e.g.
+//   ffmpeg -i - out.mp4
+//   ffmpeg -f rawvideo -pixel_format rgb24 -video_size 403x284 -i - out.mp4
+// The IDX4 format writes IndexedFrames as they are, raw packed 4-bit color
+// indices, for tools that want the VIC-II colors rather than RGB.
+class VideoWriter {
+public:
+  enum Format { Y4M, RGB, IDX4 };
+
+  ~VideoWriter() { close(); }
+
+  // Parse a --video-format= value, returns false if unknown.
+  static bool parseFormat(const char *Str, Format &F) {
+    if (!strcmp(Str, "y4m"))
+      F = Y4M;
+    else if (!strcmp(Str, "rgb"))
+      F = RGB;
+    else if (!strcmp(Str, "idx4"))
+      F = IDX4;
+    else
+      return false;
+    return true;
+  }
+
+  // The frame rate is FrameRate / FrameRateDen frames per second.
+  bool open(const char *Path, Format F, unsigned Width, unsigned Height,
+            unsigned FrameRate, unsigned FrameRateDen = 1) {
+    m_Format = F;
+    m_Width = Width;
+    m_Height = Height;
+    m_ToStdout = !strcmp(Path, "-");
+    m_File = m_ToStdout ? stdout : fopen(Path, "wb");
+    if (!m_File)
+      return false;
+    // For stdout the buffer is never freed as stdio may use it until exit.
+    m_Buffer = (char *)malloc(c_BufferSize);
+    setvbuf(m_File, m_Buffer, _IOFBF, c_BufferSize);
+    if (m_Format == Y4M) {
+      fprintf(m_File, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C444\n", Width,
+              Height, FrameRate, FrameRateDen);
+      m_Planes.resize(Width * Height * 3);
+    }
+    return true;
+  }
+
+  bool isOpen() const { return m_File != nullptr; }
+  bool indexed() const { return m_Format == IDX4; }
+
+  void write(const IndexedFrame &F) {
+    if (F.width() != m_Width || F.height() != m_Height || !indexed())
+      return;
+    fwrite(F.data(), F.size(), 1, m_File);
+  }
+
+  void write(const FrameBuffer &FB) {
+    if (FB.width() != m_Width || FB.height() != m_Height || indexed())
+      return;
+    if (m_Format == RGB) {
+      fwrite(FB.data(), FB.size(), 1, m_File);
+      return;
+    }
+    unsigned N = m_Width * m_Height;
+    uint8_t *Y = &m_Planes[0];
+    uint8_t *U = &m_Planes[N];
+    uint8_t *V = &m_Planes[2 * N];
+    const uint8_t *p = FB.data();
+    for (unsigned i = 0; i < N; i++, p += 3) {
+      int R = p[0], G = p[1], B = p[2];
+      Y[i] = ((66 * R + 129 * G + 25 * B + 128) >> 8) + 16;
+      U[i] = ((-38 * R - 74 * G + 112 * B + 128) >> 8) + 128;
+      V[i] = ((112 * R - 94 * G - 18 * B + 128) >> 8) + 128;
+    }
+    fputs("FRAME\n", m_File);
+    fwrite(m_Planes.data(), m_Planes.size(), 1, m_File);
+  }
+
+  void close() {
+    if (!m_File)
+      return;
+    fflush(m_File);
+    if (!m_ToStdout) {
+      fclose(m_File);
+      free(m_Buffer);
+    }
+    m_File = nullptr;
+    m_Buffer = nullptr;
+  }
+
+private:
+  static const size_t c_BufferSize = 4 << 20;
+  FILE *m_File = nullptr;
+  bool m_ToStdout = false;
+  Format m_Format = Y4M;
+  unsigned m_Width = 0;
+  unsigned m_Height = 0;
+  char *m_Buffer = nullptr;
+  std::vector<uint8_t> m_Planes;
+};
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2020 Markus Lavin (https://www.zzzconsulting.se/)
+ *
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Mono 16-bit PCM .wav file that is written as the samples arrive. Samples
+// are collected in a fixed size buffer and written a block at a time, after
+// each block the RIFF sizes in the header are updated so that the file stays
+// valid even if the simulator is killed. The 32-bit RIFF sizes limit the
+// file to about 4 GiB, samples beyond that are dropped with a warning.
+class WAVWriter {
+public:
+  ~WAVWriter() { close(); }
+
+  bool open(const char *Path, uint32_t SampleRate) {
+    m_File = fopen(Path, "wb");
+    if (!m_File)
+      return false;
+    m_SampleRate = SampleRate;
+    m_NumSamples = 0;
+    m_Fill = 0;
+    m_Full = false;
+    writeHeader();
+    return true;
+  }
+
+  bool isOpen() const { return m_File != nullptr; }
+
+  void write(int16_t Sample) {
+    if (m_Full)
+      return;
+    m_Buffer[m_Fill++] = Sample;
+    if (m_Fill == c_BufferSamples)
+      flush();
+  }
+
+  void flush() {
+    if (!m_File)
+      return;
+    if (m_Fill > c_MaxSamples - m_NumSamples) {
+      m_Fill = c_MaxSamples - m_NumSamples;
+      m_Full = true;
+      fprintf(stderr, "WAV file is full (4 GiB), dropping further audio\n");
+    }
+    fwrite(m_Buffer, sizeof(int16_t), m_Fill, m_File);
+    m_NumSamples += m_Fill;
+    m_Fill = 0;
+    writeHeader();
+    fseek(m_File, 0, SEEK_END);
+    fflush(m_File);
+  }
+
+  void close() {
+    if (!m_File)
+      return;
+    flush();
+    fclose(m_File);
+    m_File = nullptr;
+  }
+
+private:
+  void writeHeader() {
+    char ChunkID[] = {'R', 'I', 'F', 'F'};
+    char Format[] = {'W', 'A', 'V', 'E'};
+
+    char Subchunk1ID[] = {'f', 'm', 't', ' '};
+    uint32_t Subchunk1Size = 16;
+    uint16_t AudioFormat = 1;
+    uint16_t NumChannels = 1;
+    uint32_t SampleRate = m_SampleRate;
+    uint16_t BitsPerSample = 16;
+    uint32_t ByteRate = SampleRate * NumChannels * BitsPerSample / 8;
+    uint16_t BlockAlign = NumChannels * BitsPerSample / 8;
+
+    char Subchunk2ID[] = {'d', 'a', 't', 'a'};
+    uint32_t Subchunk2Size = m_NumSamples * NumChannels * BitsPerSample / 8;
+    uint32_t ChunkSize = 36 + Subchunk2Size;
+
+    fseek(m_File, 0, SEEK_SET);
+
+    // RIFF chunk descriptor.
+    fwrite(&ChunkID[0], sizeof(ChunkID), 1, m_File);
+    fwrite(&ChunkSize, sizeof(ChunkSize), 1, m_File);
+    fwrite(&Format, sizeof(Format), 1, m_File);
+
+    // fmt sub-chunk.
+    fwrite(&Subchunk1ID[0], sizeof(Subchunk1ID), 1, m_File);
+    fwrite(&Subchunk1Size, sizeof(Subchunk1Size), 1, m_File);
+    fwrite(&AudioFormat, sizeof(AudioFormat), 1, m_File);
+    fwrite(&NumChannels, sizeof(NumChannels), 1, m_File);
+    fwrite(&SampleRate, sizeof(SampleRate), 1, m_File);
+    fwrite(&ByteRate, sizeof(ByteRate), 1, m_File);
+    fwrite(&BlockAlign, sizeof(BlockAlign), 1, m_File);
+    fwrite(&BitsPerSample, sizeof(BitsPerSample), 1, m_File);
+
+    // data sub-chunk
+    fwrite(&Subchunk2ID[0], sizeof(Subchunk2ID), 1, m_File);
+    fwrite(&Subchunk2Size, sizeof(Subchunk2Size), 1, m_File);
+  }
+
+  static const unsigned c_BufferSamples = 64 * 1024;
+  // The most samples for which the RIFF chunk size (36 + data) fits.
+  static const uint32_t c_MaxSamples = (UINT32_MAX - 36) / sizeof(int16_t);
+  FILE *m_File = nullptr;
+  uint32_t m_SampleRate = 0;
+  uint32_t m_NumSamples = 0;
+  unsigned m_Fill = 0;
+  bool m_Full = false;
+  int16_t m_Buffer[c_BufferSamples];
+};
@@ -90,7 +90,7 @@ static const struct {
   uint8_t PBIdx;
   uint16_t KeyCode;
 } KeyInfo[] = {
-#define DEF_KEY(a, b, c, d) {a, b, c, d},
+#define DEF_KEY(a, b, c, d, e, f) {a, b, c, d},
 #include "keys.def"
 #undef DEF_KEY
 };